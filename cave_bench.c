@@ -0,0 +1,586 @@
+// cave_bench.c - load generator and latency benchmark for cave_server
+//
+//   cc -O2 -o cave_bench cave_bench.c
+//   ./cave_server --cmd-rate 0 --nick-timeout 0 &
+//   ./cave_bench --clients 2000 --rate 2000 --server-pid $(pidof cave_server)
+//
+// The server rate limits each client (--cmd-rate, 100 commands a second
+// by default), so either turn that off as above or spread --rate over
+// enough --senders; otherwise the server, not the bench, sets the pace.
+// Only the senders send NICK, since each one is announced to everyone,
+// so runs longer than the server's --nick-timeout need that off too.
+// Keepalive PINGs are answered.
+//
+// Opens many clients against a server on loopback. A few of them (the
+// senders) drive a mix of MSG, PING, PROFILE GET and NICK traffic at a
+// fixed total rate, and every client reads everything it is sent. Each
+// MSG carries its send time, so every delivery gives one fan-out latency
+// sample. Linux only (epoll, /proc).
+//
+// With --storm N it sends no traffic: all the clients disconnect and
+// reconnect at once, N times, and it reports how long each took from
+// connect() to the server's WELCOME.
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "cave_line.h"
+
+#define BUF_SIZE 4096
+#define MAX_EVENTS 256
+
+// ----------------------- configuration -----------------------
+
+typedef struct {
+    const char *host;
+    long port;
+    long clients;             // connections opened
+    long senders;             // of those, how many send traffic
+    long rate;                // operations per second, across all senders
+    long duration;            // seconds measured
+    long warmup;              // seconds run before measuring
+    long server_pid;          // for server CPU time, 0 to skip
+    long storm;               // reconnect rounds instead of traffic, 0 = off
+    long cmd_rate;            // the server's --cmd-rate, 0 = unlimited
+    long mix[4];              // weights of MSG, PING, PROFILE GET, NICK
+} bench_config_t;
+
+enum { OP_MSG, OP_PING, OP_PROFILE, OP_NICK, OP_KINDS };
+
+static const char *const op_name[OP_KINDS] = {
+    "MSG", "PING", "PROFILE GET", "NICK"
+};
+
+static bench_config_t cfg = {
+    .host = "127.0.0.1",
+    .port = 7777,
+    .clients = 1000,
+    .senders = 10,
+    .rate = 1000,
+    .duration = 10,
+    .warmup = 1,
+    .server_pid = 0,
+    .storm = 0,
+    .cmd_rate = 100,
+    .mix = { 100, 0, 0, 0 },
+};
+
+typedef struct {
+    const char *name;
+    long *num;
+    const char *help;
+} option_t;
+
+static const option_t options[] = {
+    { "port",       &cfg.port,       "server port" },
+    { "clients",    &cfg.clients,    "connections to open" },
+    { "senders",    &cfg.senders,    "connections that send traffic" },
+    { "rate",       &cfg.rate,       "operations per second, all senders together" },
+    { "duration",   &cfg.duration,   "seconds to measure" },
+    { "warmup",     &cfg.warmup,     "seconds to run before measuring" },
+    { "server-pid", &cfg.server_pid, "server process, for CPU per message" },
+    { "storm",      &cfg.storm,      "reconnect every client this many times, no traffic" },
+    { "cmd-rate",   &cfg.cmd_rate,   "the server's --cmd-rate, to warn about (0 = unlimited)" },
+    { "msg",        &cfg.mix[OP_MSG],     "weight of MSG in the mix" },
+    { "ping",       &cfg.mix[OP_PING],    "weight of PING in the mix" },
+    { "profile",    &cfg.mix[OP_PROFILE], "weight of PROFILE GET in the mix" },
+    { "nick",       &cfg.mix[OP_NICK],    "weight of NICK in the mix" },
+};
+
+#define NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--host ADDR] [--option value]...\n\n", prog);
+    fprintf(stderr, "  --host        server address (%s)\n", cfg.host);
+    for (size_t i = 0; i < NUM_OPTIONS; i++) {
+        fprintf(stderr, "  --%-12s %s (%ld)\n",
+                options[i].name, options[i].help, *options[i].num);
+    }
+}
+
+static int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) return -1;
+        arg += 2;
+
+        const char *val = strchr(arg, '=');
+        size_t name_len = val ? (size_t)(val - arg) : strlen(arg);
+        if (val) {
+            val++;
+        } else if (i + 1 < argc) {
+            val = argv[++i];
+        } else {
+            return -1;
+        }
+
+        if (name_len == 4 && strncmp(arg, "host", 4) == 0) {
+            cfg.host = val;
+            continue;
+        }
+
+        const option_t *opt = NULL;
+        for (size_t k = 0; k < NUM_OPTIONS; k++) {
+            if (strlen(options[k].name) == name_len &&
+                strncmp(options[k].name, arg, name_len) == 0) {
+                opt = &options[k];
+            }
+        }
+        if (!opt) return -1;
+
+        char *end;
+        errno = 0;
+        long v = strtol(val, &end, 10);
+        if (errno || *end || v < 0) return -1;
+        *opt->num = v;
+    }
+
+    long weight = 0;
+    for (int k = 0; k < OP_KINDS; k++) weight += cfg.mix[k];
+    if (weight == 0 || cfg.clients < 1) return -1;
+    if (cfg.senders < 1 || cfg.senders > cfg.clients) return -1;
+    if (cfg.rate < 1 || cfg.duration < 1) return -1;
+    return 0;
+}
+
+// ----------------------- latency histogram -----------------------
+//
+// Log-linear buckets: 16 per power of two, so a percentile is within ~6%
+// of the true value whatever its size.
+
+#define HIST_SUB  16
+#define HIST_BITS 44                         // up to ~4.8 hours in ns
+
+static uint64_t hist[HIST_BITS * HIST_SUB];
+static uint64_t hist_count;
+static uint64_t hist_max;
+
+static void hist_add(uint64_t ns) {
+    unsigned b = 0;
+    if (ns >= HIST_SUB) {
+        unsigned e = 63u - (unsigned)__builtin_clzll(ns);   // ns >= 2^e
+        b = (e - 3) * HIST_SUB + (unsigned)((ns >> (e - 4)) & (HIST_SUB - 1));
+    } else {
+        b = (unsigned)ns;
+    }
+    if (b >= HIST_BITS * HIST_SUB) b = HIST_BITS * HIST_SUB - 1;
+    hist[b]++;
+    hist_count++;
+    if (ns > hist_max) hist_max = ns;
+}
+
+// Lower bound of bucket b.
+static uint64_t hist_value(unsigned b) {
+    if (b < HIST_SUB) return b;
+    unsigned e = b / HIST_SUB + 3;
+    return ((uint64_t)HIST_SUB + b % HIST_SUB) << (e - 4);
+}
+
+static double hist_percentile(double p) {
+    uint64_t want = (uint64_t)(p * (double)hist_count);
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < HIST_BITS * HIST_SUB; b++) {
+        seen += hist[b];
+        if (seen > want) return (double)hist_value(b);
+    }
+    return (double)hist_max;
+}
+
+// ----------------------- clients -----------------------
+
+typedef struct {
+    int fd;
+    int nick_flip;                           // NICK alternates two names
+    uint64_t connecting;                     // --storm: connect() time until WELCOME
+    line_ring_t in;
+    char buf[BUF_SIZE];
+} bench_client_t;
+
+static bench_client_t *clients;
+static int epfd;
+
+static uint64_t sent[OP_KINDS];              // operations sent while measuring
+static uint64_t send_failed;                 // socket full, operation skipped
+static uint64_t delivered;                   // MSG lines received while measuring
+static uint64_t bytes_in;
+static int measuring;
+static uint64_t measure_start;               // ns; earlier MSGs don't count
+static uint64_t welcomed;                    // --storm: connections that got WELCOME
+static uint64_t refused;                     // ... or "server full", or an error
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int client_connect(bench_client_t *c, const struct sockaddr_in *addr) {
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) return -1;
+    if (connect(c->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        close(c->fd);
+        return -1;
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    line_ring_init(&c->in, c->buf, BUF_SIZE);
+    c->nick_flip = 0;
+    c->connecting = 0;
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u32 = (uint32_t)(c - clients);
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static int client_send(bench_client_t *c, const char *line, size_t len) {
+    ssize_t n = send(c->fd, line, len, MSG_NOSIGNAL);
+    if (n == (ssize_t)len) return 0;
+    // a partial line would corrupt the stream; stop using this client
+    if (n > 0) {
+        fprintf(stderr, "client %ld: short send, closing\n",
+                (long)(c - clients));
+        close(c->fd);
+        c->fd = -1;
+    }
+    send_failed++;
+    return -1;
+}
+
+static void handle_line(bench_client_t *c, const char *line, size_t len,
+                        uint64_t now) {
+    if (c->connecting) {
+        if (len >= 7 && memcmp(line, "WELCOME", 7) == 0) {
+            welcomed++;
+            hist_add(now - c->connecting);
+        } else {
+            refused++;
+        }
+        c->connecting = 0;
+        return;
+    }
+
+    // the server's keepalive
+    if (len == 4 && memcmp(line, "PING", 4) == 0) {
+        client_send(c, "PONG\r\n", 6);
+        return;
+    }
+
+    // our own traffic: "MSG @nick :b <send time>"
+    if (len < 4 || memcmp(line, "MSG ", 4) != 0) return;
+    const char *p = memchr(line, ':', len);
+    if (!p || (size_t)(line + len - p) < 4 || memcmp(p, ":b ", 3) != 0) return;
+
+    uint64_t t = 0;
+    for (p += 3; p < line + len && *p >= '0' && *p <= '9'; p++) {
+        t = t * 10 + (uint64_t)(*p - '0');
+    }
+    if (!measuring || t < measure_start) return;
+
+    delivered++;
+    hist_add(now > t ? now - t : 0);
+}
+
+static void client_read(bench_client_t *c) {
+    char scratch[BUF_SIZE];
+
+    while (c->fd >= 0) {
+        struct iovec iov[2];
+        int cnt = line_ring_space(&c->in, iov);
+        if (cnt == 0) {
+            // longer than anything we expect: skip it
+            line_ring_drop(&c->in, line_ring_len(&c->in));
+            continue;
+        }
+
+        ssize_t n = readv(c->fd, iov, cnt);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) {
+            if (c->connecting) {
+                refused++;
+                c->connecting = 0;
+            } else if (!cfg.storm) {
+                fprintf(stderr, "client %ld: disconnected\n", (long)(c - clients));
+            }
+            close(c->fd);
+            c->fd = -1;
+            return;
+        }
+        line_ring_commit(&c->in, (size_t)n);
+        bytes_in += (uint64_t)n;
+
+        uint64_t now = now_ns();
+        size_t len;
+        const char *line;
+        while ((line = line_ring_next(&c->in, scratch, &len)) != NULL) {
+            handle_line(c, line, len, now);
+        }
+    }
+}
+
+// One operation from a random sender, picked by the mix weights.
+static void send_op(void) {
+    long weight = 0;
+    for (int k = 0; k < OP_KINDS; k++) weight += cfg.mix[k];
+
+    long r = rand() % weight;
+    int op = 0;
+    while (r >= cfg.mix[op]) r -= cfg.mix[op++];
+
+    long s = rand() % cfg.senders;
+    bench_client_t *c = &clients[s];
+    if (c->fd < 0) return;
+
+    char line[128];
+    int len = 0;
+    switch (op) {
+    case OP_MSG:
+        len = snprintf(line, sizeof(line), "MSG :b %llu\r\n",
+                       (unsigned long long)now_ns());
+        break;
+    case OP_PING:
+        len = snprintf(line, sizeof(line), "PING\r\n");
+        break;
+    case OP_PROFILE:
+        len = snprintf(line, sizeof(line), "PROFILE GET bench%ld\r\n",
+                       rand() % cfg.senders);
+        break;
+    case OP_NICK:
+        c->nick_flip ^= 1;
+        len = snprintf(line, sizeof(line), "NICK bench%ld%s\r\n",
+                       s, c->nick_flip ? "x" : "");
+        break;
+    }
+    if (client_send(c, line, (size_t)len) == 0 && measuring) sent[op]++;
+}
+
+static void poll_clients(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        client_read(&clients[events[i].data.u32]);
+    }
+}
+
+// ----------------------- reconnect storm -----------------------
+
+// Like client_connect(), but doesn't wait for the handshake.
+static int client_start(bench_client_t *c, const struct sockaddr_in *addr) {
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) return -1;
+    fcntl(c->fd, F_SETFL, O_NONBLOCK);
+    c->connecting = now_ns();
+    if (connect(c->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+        errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    line_ring_init(&c->in, c->buf, BUF_SIZE);
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u32 = (uint32_t)(c - clients);
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+// Drops every client and reconnects them all at once, cfg.storm times.
+static void run_storm(const struct sockaddr_in *addr) {
+    uint64_t total = 0;
+    double slowest = 0;
+
+    for (long round = 0; round < cfg.storm; round++) {
+        for (long i = 0; i < cfg.clients; i++) {
+            if (clients[i].fd >= 0) close(clients[i].fd);
+            clients[i].fd = -1;
+        }
+        struct timespec pause = { 0, 100000000 };
+        nanosleep(&pause, NULL);              // let the server see them go
+
+        welcomed = refused = 0;
+        uint64_t start = now_ns();
+        for (long i = 0; i < cfg.clients; i++) {
+            if (client_start(&clients[i], addr) < 0) {
+                refused++;
+                clients[i].connecting = 0;
+            }
+        }
+
+        uint64_t give_up = start + 30 * 1000000000ull;
+        while (welcomed + refused < (uint64_t)cfg.clients && now_ns() < give_up) {
+            poll_clients(10);
+        }
+        double secs = (double)(now_ns() - start) / 1e9;
+        uint64_t lost = (uint64_t)cfg.clients - welcomed - refused;
+
+        printf("round %ld: %llu welcomed, %llu refused", round + 1,
+               (unsigned long long)welcomed, (unsigned long long)refused);
+        if (lost) printf(", %llu never answered", (unsigned long long)lost);
+        printf(" in %.3f s (%.0f/s)\n", secs, (double)welcomed / secs);
+        total += welcomed;
+        if (secs > slowest) slowest = secs;
+    }
+
+    printf("%llu reconnects, slowest round %.3f s\n",
+           (unsigned long long)total, slowest);
+    if (hist_count) {
+        printf("connect to WELCOME: p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+               hist_percentile(0.50) / 1e6, hist_percentile(0.99) / 1e6,
+               hist_percentile(0.999) / 1e6, (double)hist_max / 1e6);
+    }
+}
+
+// utime + stime of a process, in seconds, or -1.
+static double process_cpu(long pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // skip "pid (comm)", which may hold spaces
+    const char *p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2) {
+        return -1;
+    }
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+// ----------------------- main -----------------------
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_port = htons((uint16_t)cfg.port);
+    if (inet_pton(AF_INET, cfg.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address: %s\n", cfg.host);
+        return 1;
+    }
+
+    epfd = epoll_create1(0);
+    clients = calloc((size_t)cfg.clients, sizeof(*clients));
+    if (epfd < 0 || !clients) {
+        perror("setup");
+        return 1;
+    }
+
+    for (long i = 0; i < cfg.clients; i++) {
+        if (client_connect(&clients[i], &addr) < 0) {
+            fprintf(stderr, "connect %ld of %ld: %s\n",
+                    i + 1, cfg.clients, strerror(errno));
+            return 1;
+        }
+        if (i % 256 == 255) poll_clients(0);
+    }
+
+    if (cfg.storm) {
+        printf("%ld clients, %ld reconnect rounds\n", cfg.clients, cfg.storm);
+        run_storm(&addr);
+        return 0;
+    }
+
+    // only senders take nicks: every NICK is announced to everyone
+    for (long i = 0; i < cfg.senders; i++) {
+        char line[64];
+        int len = snprintf(line, sizeof(line), "NICK bench%ld\r\n", i);
+        client_send(&clients[i], line, (size_t)len);
+    }
+
+    if (cfg.cmd_rate && cfg.rate > cfg.cmd_rate * cfg.senders) {
+        fprintf(stderr, "warning: %ld ops/s over %ld senders is more than the "
+                "server's --cmd-rate %ld per client allows; run the server "
+                "with --cmd-rate 0 or use more --senders\n",
+                cfg.rate, cfg.senders, cfg.cmd_rate);
+    }
+
+    printf("%ld clients (%ld sending), %ld ops/s, %lds warmup + %lds\n",
+           cfg.clients, cfg.senders, cfg.rate, cfg.warmup, cfg.duration);
+    fflush(stdout);
+
+    uint64_t start = now_ns();
+    uint64_t warm_end = start + (uint64_t)cfg.warmup * 1000000000u;
+    uint64_t end = warm_end + (uint64_t)cfg.duration * 1000000000u;
+    uint64_t ops_done = 0;
+    double cpu_start = 0;
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= end) break;
+        if (!measuring && now >= warm_end) {
+            measuring = 1;
+            measure_start = now;
+            if (cfg.server_pid) cpu_start = process_cpu(cfg.server_pid);
+        }
+
+        // keep to the rate however long the last poll took
+        uint64_t due = (now - start) * (uint64_t)cfg.rate / 1000000000u;
+        while (ops_done < due) {
+            send_op();
+            ops_done++;
+        }
+        poll_clients(1);
+    }
+
+    double cpu_end = cfg.server_pid ? process_cpu(cfg.server_pid) : -1;
+    double secs = (double)(now_ns() - measure_start) / 1e9;
+
+    // let the last deliveries arrive
+    uint64_t drain_end = now_ns() + 1000000000u;
+    while (now_ns() < drain_end) poll_clients(10);
+
+    uint64_t ops = 0;
+    for (int k = 0; k < OP_KINDS; k++) ops += sent[k];
+
+    printf("sent %llu ops (%.0f/s)", (unsigned long long)ops, ops / secs);
+    for (int k = 0; k < OP_KINDS; k++) {
+        if (cfg.mix[k]) printf(", %s %llu", op_name[k], (unsigned long long)sent[k]);
+    }
+    if (send_failed) printf(", %llu skipped (socket full)", (unsigned long long)send_failed);
+    printf("\n");
+
+    printf("delivered %llu MSG (%.0f/s), %.1f MB in\n",
+           (unsigned long long)delivered, delivered / secs, bytes_in / 1e6);
+    if (hist_count) {
+        printf("fan-out latency: p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+               hist_percentile(0.50) / 1e6, hist_percentile(0.99) / 1e6,
+               hist_percentile(0.999) / 1e6, (double)hist_max / 1e6);
+    }
+    if (cpu_start >= 0 && cpu_end >= 0 && cfg.server_pid) {
+        double cpu = cpu_end - cpu_start;
+        printf("server cpu: %.2f s (%.0f%%)", cpu, 100 * cpu / secs);
+        if (sent[OP_MSG]) printf(", %.1f us/MSG", cpu * 1e6 / (double)sent[OP_MSG]);
+        if (delivered) printf(", %.3f us/delivery", cpu * 1e6 / (double)delivered);
+        printf("\n");
+    }
+    return 0;
+}
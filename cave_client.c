@@ -10,6 +10,8 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 
+#include "cave_line.h"
+
 #define BUF_SIZE 4096
 
 // Simple ANSI color codes for a "Discord-ish" feel
@@ -30,7 +32,7 @@ static char current_nick[CAVE_NICK_MAX] = "";
 
 // For assembling network data into lines
 static char net_buf[BUF_SIZE];
-static size_t net_len = 0;
+static line_ring_t net_in = { net_buf, BUF_SIZE, 0, 0, 0 };
 
 // Simple "currently viewed profile" state
 typedef struct {
@@ -82,6 +84,65 @@ static void show_profile_view(void) {
     printf(COL_PROFILE "---------------------------" COL_RESET "\n");
 }
 
+// ------------------------ LONG MESSAGES ------------------------
+
+// Messages that are still arriving in MSGPART pieces, by sender (the
+// line's "[#chan] @nick :" after the verb).
+#define PARTIAL_SLOTS 8
+#define PARTIAL_MAX   (64 * 1024)
+
+typedef struct {
+    char key[CAVE_NICK_MAX + 64];
+    char *text;
+    size_t len;
+} partial_t;
+
+static partial_t partials[PARTIAL_SLOTS];
+
+static partial_t *partial_find(const char *key) {
+    for (int i = 0; i < PARTIAL_SLOTS; i++) {
+        if (partials[i].text && strcmp(partials[i].key, key) == 0) {
+            return &partials[i];
+        }
+    }
+    return NULL;
+}
+
+static void partial_add(const char *key, const char *piece) {
+    partial_t *pm = partial_find(key);
+    if (!pm) {
+        for (int i = 0; i < PARTIAL_SLOTS && !pm; i++) {
+            if (!partials[i].text) pm = &partials[i];
+        }
+        if (!pm) return;             // too many at once; show just the end
+        snprintf(pm->key, sizeof(pm->key), "%s", key);
+        pm->text = calloc(1, 1);
+        pm->len = 0;
+        if (!pm->text) return;
+    }
+
+    size_t n = strlen(piece);
+    if (pm->len + n > PARTIAL_MAX) n = PARTIAL_MAX - pm->len;
+    char *text = realloc(pm->text, pm->len + n + 1);
+    if (!text) return;
+    memcpy(text + pm->len, piece, n);
+    pm->len += n;
+    text[pm->len] = '\0';
+    pm->text = text;
+}
+
+// The whole message, given its last piece, or NULL if it came in one go.
+// The caller frees it.
+static char *partial_take(const char *key, const char *last) {
+    partial_t *pm = partial_find(key);
+    if (!pm) return NULL;
+
+    partial_add(key, last);
+    char *text = pm->text;
+    pm->text = NULL;
+    return text;
+}
+
 // ------------------------ SERVER MESSAGE PARSING ------------------------
 
 static void handle_net_line(const char *line) {
@@ -92,9 +153,38 @@ static void handle_net_line(const char *line) {
         return;
     }
 
-    // Chat messages: MSG @nick :text
-    if (strncmp(line, "MSG ", 4) == 0) {
-        const char *p = line + 4;
+    // End of a HISTORY replay: HISTORY END [#chan]
+    if (strncmp(line, "HISTORY END", 11) == 0) {
+        printf("\n" COL_SYS "[end of history]" COL_RESET "\n");
+        return;
+    }
+
+    // Channel joins/parts: JOIN #chan @nick, PART #chan @nick
+    if (strncmp(line, "JOIN ", 5) == 0 || strncmp(line, "PART ", 5) == 0) {
+        const char *p = line + 5;
+        const char *at = strchr(p, '@');
+        int chan_len = (int)strcspn(p, " ");
+        printf("\n" COL_SYS "[%.*s] %s %s" COL_RESET "\n",
+               chan_len, p, at ? at + 1 : "someone",
+               line[0] == 'J' ? "joined" : "left");
+        return;
+    }
+
+    // Chat messages: MSG @nick :text, or MSG #chan @nick :text. Long
+    // ones arrive as MSGPART pieces first, with the same prefix.
+    int part = strncmp(line, "MSGPART ", 8) == 0;
+    if (part || strncmp(line, "MSG ", 4) == 0) {
+        const char *p = line + (part ? 8 : 4);
+
+        // Example line: "MSG #cave @surge :hello"
+        const char *chan = NULL;
+        int chan_len = 0;
+        if (*p == '#') {
+            chan = p;
+            chan_len = (int)strcspn(p, " ");
+            p += chan_len;
+            while (*p == ' ') p++;
+        }
 
         // Example line: "MSG @surge :hello"
         if (*p == '@') p++;
@@ -109,10 +199,31 @@ static void handle_net_line(const char *line) {
         const char *colon = strchr(line, ':');
         const char *body = colon ? (colon + 1) : "";
 
+        // "[#chan] @nick :" says whose message it is
+        const char *from = line + (part ? 8 : 4);
+        char key[CAVE_NICK_MAX + 64];
+        int key_len = colon ? (int)(colon - from) : (int)strlen(from);
+        if (key_len > (int)sizeof(key) - 1) key_len = (int)sizeof(key) - 1;
+        snprintf(key, sizeof(key), "%.*s", key_len, from);
+
+        if (part) {
+            partial_add(key, body);
+            return;
+        }
+
+        char *whole = partial_take(key, body);
+        if (whole) body = whole;
+
         const char *color = (current_nick[0] && strcmp(current_nick, nick) == 0)
                             ? COL_ME : COL_NICK;
 
-        printf("\n%s%s%s: %s\n", color, nick, COL_RESET, body);
+        if (chan) {
+            printf("\n[%.*s] %s%s%s: %s\n", chan_len, chan,
+                   color, nick, COL_RESET, body);
+        } else {
+            printf("\n%s%s%s: %s\n", color, nick, COL_RESET, body);
+        }
+        free(whole);
         return;
     }
 
@@ -199,35 +310,40 @@ static void handle_net_line(const char *line) {
 
 // Assemble lines from the TCP stream and feed into handle_net_line
 static int handle_net_data(int fd) {
-    ssize_t n = recv(fd, net_buf + net_len, BUF_SIZE - net_len - 1, 0);
+    struct iovec iov[2];
+    int cnt = line_ring_space(&net_in, iov);
+    if (cnt == 0) {
+        // a line too long to ever fit: throw it away
+        line_ring_drop(&net_in, line_ring_len(&net_in));
+        cnt = line_ring_space(&net_in, iov);
+    }
+
+    ssize_t n = readv(fd, iov, cnt);
     if (n <= 0) {
         return -1; // disconnected or error
     }
+    line_ring_commit(&net_in, (size_t)n);
 
-    net_len += (size_t)n;
-    net_buf[net_len] = '\0';
-
-    char *start = net_buf;
+    char scratch[BUF_SIZE];
     for (;;) {
-        char *newline = strstr(start, "\n");
-        if (!newline) break;
+        size_t len;
+        const char *text = line_ring_next(&net_in, scratch, &len);
+        if (!text) break;
 
-        *newline = '\0';
-        if (newline > start && *(newline - 1) == '\r') {
-            *(newline - 1) = '\0';
-        }
+        if (len > 0) {
+            char line[BUF_SIZE];
+            memcpy(line, text, len);
+            line[len] = '\0';
 
-        if (*start) {
-            handle_net_line(start);
+            // the server's keepalive; it hangs up if we don't answer
+            if (strcmp(line, "PING") == 0) {
+                send_line(fd, "PONG");
+                continue;
+            }
+            handle_net_line(line);
         }
-
-        start = newline + 1;
     }
 
-    size_t remaining = net_buf + net_len - start;
-    memmove(net_buf, start, remaining);
-    net_len = remaining;
-
     return 0;
 }
 
@@ -274,6 +390,55 @@ static void handle_user_input(int fd) {
             return;
         }
 
+        // /join #CHANNEL
+        if (strncmp(inbuf, "/join ", 6) == 0) {
+            const char *chan = inbuf + 6;
+            if (*chan != '#') {
+                printf(COL_ERR "Usage: /join #CHANNEL" COL_RESET "\n");
+                return;
+            }
+            char line[BUF_SIZE];
+            snprintf(line, sizeof(line), "JOIN %s", chan);
+            send_line(fd, line);
+            return;
+        }
+
+        // /part #CHANNEL
+        if (strncmp(inbuf, "/part ", 6) == 0) {
+            const char *chan = inbuf + 6;
+            if (*chan != '#') {
+                printf(COL_ERR "Usage: /part #CHANNEL" COL_RESET "\n");
+                return;
+            }
+            char line[BUF_SIZE];
+            snprintf(line, sizeof(line), "PART %s", chan);
+            send_line(fd, line);
+            return;
+        }
+
+        // /msg #CHANNEL TEXT
+        if (strncmp(inbuf, "/msg ", 5) == 0) {
+            const char *chan = inbuf + 5;
+            const char *text = strchr(chan, ' ');
+            if (*chan != '#' || !text || text[1] == '\0') {
+                printf(COL_ERR "Usage: /msg #CHANNEL TEXT" COL_RESET "\n");
+                return;
+            }
+            char line[BUF_SIZE];
+            snprintf(line, sizeof(line), "MSG %.*s :%s",
+                     (int)(text - chan), chan, text + 1);
+            send_line(fd, line);
+            return;
+        }
+
+        // /history [#CHANNEL] [N]
+        if (strcmp(inbuf, "/history") == 0 || strncmp(inbuf, "/history ", 9) == 0) {
+            char line[BUF_SIZE];
+            snprintf(line, sizeof(line), "HISTORY%s", inbuf + 8);
+            send_line(fd, line);
+            return;
+        }
+
         // /profile get NICK
         if (strncmp(inbuf, "/profile get ", 13) == 0) {
             const char *nick = inbuf + 13;
@@ -328,7 +493,7 @@ static void handle_user_input(int fd) {
 
         // Unknown slash command
         printf(COL_ERR "Unknown command: %s" COL_RESET "\n", inbuf);
-        printf("Known: /nick, /profile get, /profile set displayname|bio|pronouns, /quit\n");
+        printf("Known: /nick, /join, /part, /msg, /history, /profile get, /profile set displayname|bio|pronouns, /quit\n");
         return;
     }
 
@@ -381,6 +546,8 @@ int main(int argc, char **argv) {
     printf("      /profile set bio TEXT\n");
     printf("      /profile set pronouns TEXT\n");
     printf("      /profile get NICK\n");
+    printf("      /join #CHANNEL, /part #CHANNEL, /msg #CHANNEL TEXT\n");
+    printf("      /history [#CHANNEL] [N]\n");
     print_prompt();
 
     for (;;) {
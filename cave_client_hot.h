@@ -0,0 +1,38 @@
+// cave_client_hot.h - the fan-out fields at the head of client_t
+//
+// Shared by cave_server.c and cave_fanout_bench.c, so the benchmark
+// measures the layout the server really has. Everything a fan-out touches
+// per recipient (send_frame and out_push) goes here, packed into the
+// first cache line; the rest of client_t follows. Expand it at the start
+// of the struct, with frame_t already declared.
+//
+// This packs each record, it doesn't split the hot fields out into an
+// array of their own: a fan-out still strides over whole client_t
+// records, CAVE_CLIENT_SIZE bytes apart, but touches one line of each.
+#ifndef CAVE_CLIENT_HOT_H
+#define CAVE_CLIENT_HOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// sizeof(client_t) in the epoll and select builds, which the server
+// checks; the bench spaces its records by it.
+#define CAVE_CLIENT_SIZE 576
+
+#define CAVE_CLIENT_HOT_FIELDS                                              \
+    _Alignas(64) int fd;       /* socket descriptor */                      \
+    int closing;               /* queued for teardown, ignore I/O */        \
+    int binary;                /* switched to binary framing */             \
+    int flush_pending;         /* on flush_list for this tick */            \
+    int write_blocked;         /* socket full, waiting for EV_WRITE */      \
+                                                                            \
+    /* outbound queue: frames the socket hasn't fully taken yet */          \
+    uint32_t out_head;         /* oldest frame */                           \
+    uint32_t out_count;        /* frames queued */                          \
+    uint32_t out_cap;          /* ring size, a power of two */              \
+    frame_t **out_q;           /* ring of frame references */               \
+    size_t out_head_off;       /* bytes of the oldest frame already sent */ \
+    size_t out_bytes;          /* unsent bytes across the queue */          \
+    unsigned long out_dropped; /* lines discarded under SLOW_DROP */
+
+#endif
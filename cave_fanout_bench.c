@@ -0,0 +1,201 @@
+// cave_fanout_bench.c - microbenchmark for the client_t layout
+//
+//   cc -O2 -o cave_fanout_bench cave_fanout_bench.c
+//
+// Queues frames for every client the way fanout_local() and send_frame()
+// do, once with the old client_t layout (input buffer embedded ahead of
+// the outbound queue fields) and once with the hot fields packed into the
+// first cache line and the buffer kept elsewhere, and reports ns per
+// recipient for each. The new records are as big as the server's
+// client_t (CAVE_CLIENT_SIZE); the hot fields are packed within each
+// record, not split out into an array of their own. Clients are visited in slot order and in the
+// shuffled order live_clients[] ends up in after some churn.
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cave_line.h"
+#include "cave_client_hot.h"
+
+#define BUF_SIZE      4096
+#define NICK_MAX      32
+#define OUT_CAP       8              // outbound ring per client, a power of two
+#define BURST         4              // frames queued per client between flushes
+#define DELIVERIES    (32u << 20)    // recipients per run
+#define COLD_BYTES    448            // the rest of the old client_t: timers...
+
+typedef struct {
+    size_t len;
+} frame_t;
+
+// client_t as it was: hot fields after the nick and the input buffer
+typedef struct {
+    int fd;
+    char nick[NICK_MAX];
+    char buf[BUF_SIZE];
+    line_ring_t in;
+    frame_t **out_q;
+    uint32_t out_head;
+    uint32_t out_count;
+    uint32_t out_cap;
+    size_t out_head_off;
+    size_t out_bytes;
+    unsigned long out_dropped;
+    int flush_pending;
+    int write_blocked;
+    int closing;
+    int awaiting;
+    int binary;
+    int admin;
+    char cold[COLD_BYTES];
+} old_client_t;
+
+// client_t now: one hot cache line, input buffer allocated separately,
+// the rest padded out to the server's size
+typedef struct {
+    CAVE_CLIENT_HOT_FIELDS
+    line_ring_t in;
+    char cold[CAVE_CLIENT_SIZE - 64 - sizeof(line_ring_t)];
+} new_client_t;
+
+_Static_assert(offsetof(new_client_t, in) <= 64,
+               "the hot fields must fit in one cache line");
+_Static_assert(sizeof(new_client_t) == CAVE_CLIENT_SIZE,
+               "new_client_t must be as big as the server's client_t");
+
+static volatile size_t sink;         // keeps the work from being optimized out
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *xmalloc(size_t n) {
+    void *p;
+    if (posix_memalign(&p, 64, n) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(p, 0, n);
+    return p;
+}
+
+static void shuffle(void **v, size_t n) {
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = (size_t)rand() % (i + 1);
+        void *t = v[i];
+        v[i] = v[j];
+        v[j] = t;
+    }
+}
+
+// send_frame()'s queueing path, followed by the per-tick flush that
+// empties the queues again, for either layout.
+#define DEFINE_RUN(name, type)                                              \
+    static double name(type **live, size_t n, type **dirty) {               \
+        frame_t f = { 64 };                                                 \
+        size_t rounds = DELIVERIES / (n * BURST);                           \
+        double t = now();                                                   \
+        for (size_t r = 0; r < rounds; r++) {                               \
+            size_t ndirty = 0;                                              \
+            for (int b = 0; b < BURST; b++) {                               \
+                for (size_t i = 0; i < n; i++) {                            \
+                    type *c = live[i];                                      \
+                    if (c->closing) continue;                               \
+                    if (c->binary) continue;                                \
+                    if (c->out_count > 0 &&                                 \
+                        c->out_bytes + f.len > (1u << 20)) {                \
+                        c->out_dropped++;                                   \
+                        continue;                                           \
+                    }                                                       \
+                    uint32_t k = (c->out_head + c->out_count) &             \
+                                 (c->out_cap - 1);                          \
+                    c->out_q[k] = &f;                                       \
+                    c->out_count++;                                         \
+                    c->out_bytes += f.len;                                  \
+                    if (!c->flush_pending && !c->write_blocked) {           \
+                        c->flush_pending = 1;                               \
+                        dirty[ndirty++] = c;                                \
+                    }                                                       \
+                }                                                           \
+            }                                                               \
+            for (size_t i = 0; i < ndirty; i++) {                           \
+                type *c = dirty[i];                                         \
+                sink += c->out_bytes + (size_t)c->fd;                       \
+                c->out_head = (c->out_head + c->out_count) &                \
+                              (c->out_cap - 1);                             \
+                c->out_count = 0;                                           \
+                c->out_bytes = 0;                                           \
+                c->flush_pending = 0;                                       \
+            }                                                               \
+        }                                                                   \
+        t = now() - t;                                                      \
+        return t * 1e9 / ((double)rounds * n * BURST);                      \
+    }
+
+DEFINE_RUN(run_old, old_client_t)
+DEFINE_RUN(run_new, new_client_t)
+
+static void bench(size_t n) {
+    old_client_t *olds = xmalloc(n * sizeof(old_client_t));
+    new_client_t *news = xmalloc(n * sizeof(new_client_t));
+    char *bufs = xmalloc(n * BUF_SIZE);
+    frame_t **queues = xmalloc(2 * n * OUT_CAP * sizeof(frame_t *));
+    old_client_t **old_live = xmalloc(n * sizeof(*old_live));
+    new_client_t **new_live = xmalloc(n * sizeof(*new_live));
+    void **dirty = xmalloc(n * sizeof(*dirty));
+
+    for (size_t i = 0; i < n; i++) {
+        old_client_t *o = &olds[i];
+        o->fd = (int)i;
+        o->out_q = queues + i * OUT_CAP;
+        o->out_cap = OUT_CAP;
+        line_ring_init(&o->in, o->buf, BUF_SIZE);
+        old_live[i] = o;
+
+        new_client_t *c = &news[i];
+        c->fd = (int)i;
+        c->out_q = queues + (n + i) * OUT_CAP;
+        c->out_cap = OUT_CAP;
+        line_ring_init(&c->in, bufs + i * BUF_SIZE, BUF_SIZE);
+        new_live[i] = c;
+    }
+
+    printf("%zu clients\n", n);
+    printf("  %-10s %7.2f ns/recipient   %-10s %7.2f ns/recipient\n",
+           "old", run_old(old_live, n, (old_client_t **)dirty),
+           "new", run_new(new_live, n, (new_client_t **)dirty));
+
+    srand(1);
+    shuffle((void **)old_live, n);
+    srand(1);
+    shuffle((void **)new_live, n);
+    printf("  %-10s %7.2f ns/recipient   %-10s %7.2f ns/recipient\n",
+           "old, churn", run_old(old_live, n, (old_client_t **)dirty),
+           "new, churn", run_new(new_live, n, (new_client_t **)dirty));
+
+    free(olds);
+    free(news);
+    free(bufs);
+    free(queues);
+    free(old_live);
+    free(new_live);
+    free(dirty);
+}
+
+int main(void) {
+    static const size_t counts[] = { 100, 1000, 10000, 50000 };
+
+    printf("client_t: old %zu bytes, new %zu bytes + %d-byte buffer "
+           "(hot fields packed per record, not a separate array)\n",
+           sizeof(old_client_t), sizeof(new_client_t), BUF_SIZE);
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        bench(counts[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+// cave_line.h - line assembly shared by cave_server.c and cave_client.c
+//
+// Input is received straight into a ring buffer and lines are taken off
+// the front with their length, so nothing is moved as lines are consumed
+// and embedded NULs don't cut a line short. The '\n' search uses SSE2 or
+// AVX2 when the compiler targets them; build with -DCAVE_LINE_SCALAR to
+// force the plain loop.
+#ifndef CAVE_LINE_H
+#define CAVE_LINE_H
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#if !defined(CAVE_LINE_SCALAR) && defined(__GNUC__) && \
+    (defined(__SSE2__) || defined(__AVX2__))
+#define CAVE_LINE_SIMD 1
+#include <immintrin.h>
+#endif
+
+// ----- newline search -----
+
+// Offset of the first '\n' in p[0..n), or n if there is none.
+static inline size_t line_find_nl_scalar(const char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == '\n') return i;
+    }
+    return n;
+}
+
+static inline size_t line_find_nl(const char *p, size_t n) {
+    size_t i = 0;
+#ifdef CAVE_LINE_SIMD
+#ifdef __AVX2__
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl32));
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+#endif
+    const __m128i nl16 = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl16));
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+#endif
+    return i + line_find_nl_scalar(p + i, n - i);
+}
+
+// ----- ring buffer -----
+
+typedef struct {
+    char *buf;
+    size_t cap;                      // size of buf, a power of two
+    size_t head;                     // free-running offset of the oldest byte
+    size_t tail;                     // free-running offset past the newest byte
+    size_t scanned;                  // bytes after head known to have no '\n'
+} line_ring_t;
+
+static inline void line_ring_init(line_ring_t *r, char *buf, size_t cap) {
+    r->buf = buf;
+    r->cap = cap;
+    r->head = 0;
+    r->tail = 0;
+    r->scanned = 0;
+}
+
+static inline size_t line_ring_len(const line_ring_t *r) {
+    return r->tail - r->head;
+}
+
+static inline size_t line_ring_room(const line_ring_t *r) {
+    return r->cap - line_ring_len(r);
+}
+
+// The free space as up to two iovecs to receive into; returns how many.
+// Follow up with line_ring_commit().
+static inline int line_ring_space(const line_ring_t *r, struct iovec iov[2]) {
+    size_t room = line_ring_room(r);
+    size_t t = r->tail & (r->cap - 1);
+    size_t first = r->cap - t;
+    if (first > room) first = room;
+    if (room == 0) return 0;
+
+    iov[0].iov_base = r->buf + t;
+    iov[0].iov_len = first;
+    if (first == room) return 1;
+    iov[1].iov_base = r->buf;
+    iov[1].iov_len = room - first;
+    return 2;
+}
+
+static inline void line_ring_commit(line_ring_t *r, size_t n) {
+    r->tail += n;
+}
+
+// Copies in as much of data as fits; returns how much that was.
+static inline size_t line_ring_write(line_ring_t *r, const char *data, size_t n) {
+    struct iovec iov[2];
+    int cnt = line_ring_space(r, iov);
+    size_t done = 0;
+    for (int i = 0; i < cnt && done < n; i++) {
+        size_t k = n - done < iov[i].iov_len ? n - done : iov[i].iov_len;
+        memcpy(iov[i].iov_base, data + done, k);
+        done += k;
+    }
+    line_ring_commit(r, done);
+    return done;
+}
+
+// The first n buffered bytes in one piece: in place, unless they wrap
+// around the end of the ring, in which case they are copied to scratch.
+static inline const char *line_ring_peek(const line_ring_t *r, size_t n,
+                                         char *scratch) {
+    size_t h = r->head & (r->cap - 1);
+    if (h + n <= r->cap) return r->buf + h;
+
+    size_t first = r->cap - h;
+    memcpy(scratch, r->buf + h, first);
+    memcpy(scratch + first, r->buf, n - first);
+    return scratch;
+}
+
+static inline void line_ring_drop(line_ring_t *r, size_t n) {
+    r->head += n;
+    r->scanned = r->scanned > n ? r->scanned - n : 0;
+}
+
+// Length of the first complete line, '\n' included, or 0 if there isn't
+// one yet. Bytes already searched aren't searched again.
+static inline size_t line_ring_find(line_ring_t *r) {
+    size_t len = line_ring_len(r);
+    while (r->scanned < len) {
+        size_t h = (r->head + r->scanned) & (r->cap - 1);
+        size_t seg = r->cap - h;
+        if (seg > len - r->scanned) seg = len - r->scanned;
+
+        size_t i = line_find_nl(r->buf + h, seg);
+        if (i < seg) return r->scanned + i + 1;
+        r->scanned += seg;
+    }
+    return 0;
+}
+
+// Takes the first complete line off the ring, without its "\n" or
+// "\r\n", or returns NULL if there isn't one. scratch needs room for
+// r->cap bytes; the line stays valid until the ring is written to again.
+static inline const char *line_ring_next(line_ring_t *r, char *scratch,
+                                         size_t *len) {
+    size_t h = r->head & (r->cap - 1);
+    size_t avail = r->tail - r->head;
+    size_t seg = r->cap - h < avail ? r->cap - h : avail;
+    const char *line = r->buf + h;
+    size_t n = 0;
+
+    // usually the line ends before the ring wraps, and needs no copy
+    if (r->scanned < seg) {
+        size_t i = r->scanned + line_find_nl(line + r->scanned, seg - r->scanned);
+        if (i < seg) n = i + 1;
+        else r->scanned = seg;
+    }
+    if (n == 0) {
+        n = line_ring_find(r);
+        if (n == 0) return NULL;
+        line = line_ring_peek(r, n, scratch);
+    }
+    line_ring_drop(r, n);
+
+    n--;
+    if (n > 0 && line[n - 1] == '\r') n--;
+    *len = n;
+    return line;
+}
+
+#endif // CAVE_LINE_H
@@ -0,0 +1,160 @@
+// cave_line_bench.c - microbenchmarks for cave_line.h
+//
+//   cc -O2 -o cave_line_bench cave_line_bench.c
+//   cc -O2 -mavx2 -o cave_line_bench cave_line_bench.c
+//
+// Feeds pipelined input through the old strstr()/memmove() splitter and
+// through the ring buffer, in recv()-sized chunks, and reports bytes/sec
+// for each, plus the raw newline search.
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cave_line.h"
+
+#define BUF_SIZE   4096
+#define INPUT_SIZE (64u << 20)
+#define CHUNK      1500              // bytes per simulated recv()
+
+static volatile size_t sink;         // keeps the work from being optimized out
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Lines of random length around avg, each ending in "\r\n".
+static char *make_input(size_t avg) {
+    char *in = malloc(INPUT_SIZE + 1);
+    if (!in) {
+        perror("malloc");
+        exit(1);
+    }
+
+    size_t pos = 0;
+    while (pos < INPUT_SIZE) {
+        size_t len = avg / 2 + (size_t)rand() % (avg + 1);
+        if (len < 6) len = 6;
+        if (len > BUF_SIZE - 2) len = BUF_SIZE - 2;
+        if (pos + len > INPUT_SIZE) len = INPUT_SIZE - pos;
+
+        memset(in + pos, 'x', len);
+        memcpy(in + pos, "MSG :", len < 5 ? len : 5);
+        if (len >= 2) {
+            in[pos + len - 2] = '\r';
+            in[pos + len - 1] = '\n';
+        }
+        pos += len;
+    }
+    in[INPUT_SIZE] = '\0';
+    return in;
+}
+
+static void on_line(const char *line, size_t len) {
+    sink += len + (unsigned char)line[0];
+}
+
+// The splitter the server and client used before cave_line.h.
+static size_t run_strstr(const char *in) {
+    static char buf[BUF_SIZE];
+    size_t buf_len = 0, lines = 0;
+
+    for (size_t off = 0; off < INPUT_SIZE; ) {
+        size_t n = INPUT_SIZE - off < CHUNK ? INPUT_SIZE - off : CHUNK;
+        if (n > BUF_SIZE - buf_len - 1) n = BUF_SIZE - buf_len - 1;
+        memcpy(buf + buf_len, in + off, n);
+        buf_len += n;
+        buf[buf_len] = '\0';
+        off += n;
+
+        char *start = buf;
+        for (;;) {
+            char *newline = strstr(start, "\n");
+            if (!newline) break;
+
+            *newline = '\0';
+            if (newline > start && *(newline - 1) == '\r') {
+                *(newline - 1) = '\0';
+            }
+            on_line(start, (size_t)(newline - start));
+            lines++;
+            start = newline + 1;
+        }
+
+        size_t remaining = buf + buf_len - start;
+        memmove(buf, start, remaining);
+        buf_len = remaining;
+    }
+    return lines;
+}
+
+static size_t run_ring(const char *in) {
+    static char buf[BUF_SIZE], scratch[BUF_SIZE];
+    line_ring_t r;
+    size_t lines = 0;
+
+    line_ring_init(&r, buf, BUF_SIZE);
+    for (size_t off = 0; off < INPUT_SIZE; ) {
+        size_t n = INPUT_SIZE - off < CHUNK ? INPUT_SIZE - off : CHUNK;
+        off += line_ring_write(&r, in + off, n);
+
+        size_t len;
+        const char *line;
+        while ((line = line_ring_next(&r, scratch, &len)) != NULL) {
+            on_line(line, len);
+            lines++;
+        }
+    }
+    return lines;
+}
+
+static void bench_split(const char *name, size_t (*fn)(const char *),
+                        const char *in) {
+    double t = now();
+    size_t lines = fn(in);
+    t = now() - t;
+    printf("  %-8s %8.1f MB/s  %9.1f Mlines/s\n", name,
+           INPUT_SIZE / t / 1e6, lines / t / 1e6);
+}
+
+static void bench_find(const char *name,
+                       size_t (*fn)(const char *, size_t), const char *in) {
+    double t = now();
+    size_t lines = 0;
+    for (size_t off = 0; off < INPUT_SIZE; ) {
+        off += fn(in + off, INPUT_SIZE - off) + 1;
+        lines++;
+    }
+    t = now() - t;
+    sink += lines;
+    printf("  %-8s %8.1f MB/s\n", name, INPUT_SIZE / t / 1e6);
+}
+
+int main(void) {
+    static const size_t avgs[] = { 16, 64, 256, 1024 };
+
+#if defined(__AVX2__) && defined(CAVE_LINE_SIMD)
+    printf("newline search: AVX2\n");
+#elif defined(CAVE_LINE_SIMD)
+    printf("newline search: SSE2\n");
+#else
+    printf("newline search: scalar\n");
+#endif
+
+    for (size_t i = 0; i < sizeof(avgs) / sizeof(avgs[0]); i++) {
+        srand(1);
+        char *in = make_input(avgs[i]);
+
+        printf("lines of ~%zu bytes, %d-byte reads\n", avgs[i], CHUNK);
+        bench_split("strstr", run_strstr, in);
+        bench_split("ring", run_ring, in);
+        bench_find("scalar", line_find_nl_scalar, in);
+        bench_find("find", line_find_nl, in);
+        free(in);
+    }
+    return 0;
+}
@@ -1,370 +1,5791 @@
 // cave_server.c - CAVE chat server with basic profile support
 #define _POSIX_C_SOURCE 200112L
+#ifdef __linux__
+#define _GNU_SOURCE                 // accept4(), syscall()
+#endif
+#ifdef CAVE_USE_URING
+#define _DEFAULT_SOURCE             // syscall()
+#endif
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>     // for strcasecmp
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>            // close_range, for the hot upgrade
+#endif
+
+#include "cave_line.h"
+#include "cave_client_hot.h"
+
+// Event loop backend: epoll on Linux, select() everywhere else.
+// Build with -DCAVE_USE_SELECT to force the select() fallback, or with
+// -DCAVE_USE_URING for io_uring (Linux 6.0 or newer, no liburing needed).
+#if defined(CAVE_USE_URING)
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#elif defined(__linux__) && !defined(CAVE_USE_SELECT)
+#define CAVE_USE_EPOLL 1
+#include <sys/epoll.h>
+#else
 #include <sys/select.h>
+#endif
 
 #define CAVE_PORT 7777
-#define MAX_CLIENTS 32
+#define CLIENT_SLAB_SIZE 64      // client_t objects per slab allocation
 #define BUF_SIZE 4096
+#define OUTQ_MAX_DEFAULT (256 * 1024)
+#define BACKLOG_DEFAULT 4096     // the kernel caps it at net.core.somaxconn
+#define ACCEPT_BATCH_DEFAULT 64  // connections taken per loop pass
+#define FLUSH_EAGER (64 * 1024)  // flush mid-tick once this much is queued
+#define FLUSH_IOV 64             // frames handed to one writev()
+#define HISTORY_DEFAULT 100
+#define BIN_FIELDS_MAX 8         // fields in one binary frame
+#define HISTORY_LIMIT 100000
+#define MAX_MESSAGE_DEFAULT (64 * 1024)
+#define MAX_MESSAGE_LIMIT (16 * 1024 * 1024)
+#define MSG_PIECE (BUF_SIZE / 2) // text per MSGPART, leaving room for the prefix
+#define UPGRADE_POLL_NS 10000000 // ns between checks while a hot upgrade runs
+
+// input state of a line too long for the input buffer
+#define LONG_NONE 0
+#define LONG_MSG  1              // a MSG, forwarded in MSGPART pieces
+#define LONG_SKIP 2              // anything else, discarded up to its newline
+#define LONG_PART 3              // a MSGPART, forwarded likewise
+
+// multishot recv state of a client (io_uring)
+#define RECV_ARMED      0
+#define RECV_CANCELLING 1        // paused; waiting for the recv to end
+#define RECV_IDLE       2        // paused; nothing armed
+
+// why a client's input is paused (client_t.awaiting)
+#define AWAIT_REPLY 1            // a command needs another worker's answer
+#define AWAIT_TURN  2            // out of quota or rate; see client_admit()
+#define AWAIT_UPGRADE 4          // handing over to a new binary; see upgrade_poll()
+
+// Profile-related limits; the profile field ones are bytes of text and
+// can be changed with --max-display etc.
+#define CAVE_NICK_MAX        32
+#define DISPLAY_MAX_DEFAULT  64
+#define BIO_MAX_DEFAULT     512
+#define PRONOUNS_MAX_DEFAULT 32
+#define PROFILE_FIELD_LIMIT (BUF_SIZE - 64) // a PROFILE SET must fit on one line
+
+// Channel limits
+#define CAVE_CHAN_MAX        32      // name, including the leading '#'
+#define CAVE_CHANNELS_MAX    16      // channels one client can be in
+#define MAX_CHANNELS_DEFAULT 4096    // channels one worker keeps, see channel_create()
+
+// ----------------------- configuration -----------------------
+
+#define SLOW_DISCONNECT 0    // close connections whose queue overflows
+#define SLOW_DROP       1    // discard lines for them until it drains
+
+#define FLOOD_THROTTLE  0    // pause input from clients over their rate
+#define FLOOD_DISCONNECT 1   // close them instead
+
+#define IDLE_TIMEOUT_DEFAULT 60   // seconds of silence before a keepalive PING
+#define PONG_TIMEOUT_DEFAULT 30   // seconds to answer it
+#define NICK_TIMEOUT_DEFAULT 60   // seconds a new connection has to send NICK
+
+typedef struct {
+    long port;
+    long threads;             // worker threads, each with its own listener
+    long backlog;             // listen() queue length, per listener
+    long accept_batch;        // connections accepted per loop pass, 0 = no limit
+    long outq_max;            // unsent bytes allowed per client
+    long history;             // messages kept for HISTORY, globally and per channel
+    long max_channels;        // channels each worker keeps, with members or history
+    long max_message;         // longest MSG text, in bytes, however it is sent
+    const char *slow_policy;  // what to do past outq_max (see parse_args)
+    int slow_mode;            // SLOW_* resolved from slow_policy
+    const char *profile_store; // file profiles persist in
+    long max_display;         // longest DISPLAYNAME, in bytes
+    long max_pronouns;        // longest PRONOUNS
+    long max_bio;             // longest BIO
+    long cmd_rate;            // commands per second per client, 0 = unlimited
+    long cmd_burst;           // commands a client may send at once
+    long byte_rate;           // input bytes per second per client, 0 = unlimited
+    long byte_burst;
+    long tick_lines;          // commands per client per loop pass, 0 = no limit
+    long idle_timeout;        // seconds idle before we PING, 0 = never
+    long pong_timeout;        // seconds to answer before we hang up
+    long nick_timeout;        // seconds to send NICK after connecting, 0 = forever
+    const char *flood_policy; // what to do past the rates (see parse_args)
+    int flood_mode;           // FLOOD_* resolved from flood_policy
+    uint64_t cmd_ns;          // ns each command costs, from cmd_rate
+    uint64_t byte_ns;         // ns each input byte costs, from byte_rate
+    long metrics_port;        // HTTP /metrics listener, 0 for none
+    const char *metrics_addr; // address it binds to
+    long admin_local;         // 1 lets loopback clients use STATS
+} server_config_t;
+
+static server_config_t cfg = {
+    .port        = CAVE_PORT,
+    .threads     = 1,
+    .backlog     = BACKLOG_DEFAULT,
+    .accept_batch = ACCEPT_BATCH_DEFAULT,
+    .outq_max    = OUTQ_MAX_DEFAULT,
+    .history     = HISTORY_DEFAULT,
+    .max_channels = MAX_CHANNELS_DEFAULT,
+    .max_message = MAX_MESSAGE_DEFAULT,
+    .slow_policy = "disconnect",
+    .slow_mode   = SLOW_DISCONNECT,
+    .profile_store = "cave_profiles.db",
+    .max_display = DISPLAY_MAX_DEFAULT,
+    .max_pronouns = PRONOUNS_MAX_DEFAULT,
+    .max_bio     = BIO_MAX_DEFAULT,
+    .cmd_rate    = 100,
+    .cmd_burst   = 200,
+    .byte_rate   = 256 * 1024,
+    .byte_burst  = 64 * 1024,
+    .tick_lines  = 64,
+    .idle_timeout = IDLE_TIMEOUT_DEFAULT,
+    .pong_timeout = PONG_TIMEOUT_DEFAULT,
+    .nick_timeout = NICK_TIMEOUT_DEFAULT,
+    .flood_policy = "throttle",
+    .flood_mode  = FLOOD_THROTTLE,
+    .metrics_port = 0,
+    .metrics_addr = "127.0.0.1",
+    .admin_local = 0,
+};
+
+typedef struct {
+    const char *name;        // matched as --name VALUE or --name=VALUE
+    long *num;               // numeric option, or NULL
+    const char **str;        // string option, or NULL
+    const char *help;
+} option_t;
+
+static const option_t options[] = {
+    { "port",        &cfg.port,     NULL, "TCP port to listen on" },
+    { "threads",     &cfg.threads,  NULL, "worker threads (clients are sharded across them)" },
+    { "backlog",     &cfg.backlog,  NULL, "pending connections each listener queues" },
+    { "accept-batch", &cfg.accept_batch, NULL,
+      "connections a worker accepts per loop pass (0 = no limit)" },
+    { "outq-max",    &cfg.outq_max, NULL, "max unsent bytes queued per client" },
+    { "history",     &cfg.history,  NULL, "messages kept for HISTORY, globally and per channel (0 = off)" },
+    { "max-channels", &cfg.max_channels, NULL,
+      "channels each worker keeps; the least recently used without members go first" },
+    { "max-message", &cfg.max_message, NULL,
+      "longest message in bytes; longer ones are cut off (see MSGPART)" },
+    { "slow-policy", NULL, &cfg.slow_policy,
+      "disconnect|drop: what to do when a client exceeds outq-max" },
+    { "profile-store", NULL, &cfg.profile_store, "file profiles are kept in" },
+    { "max-display", &cfg.max_display, NULL, "longest profile DISPLAYNAME, in bytes" },
+    { "max-pronouns", &cfg.max_pronouns, NULL, "longest profile PRONOUNS, in bytes" },
+    { "max-bio",     &cfg.max_bio,  NULL, "longest profile BIO, in bytes" },
+    { "cmd-rate",    &cfg.cmd_rate,   NULL, "commands per second per client (0 = unlimited)" },
+    { "cmd-burst",   &cfg.cmd_burst,  NULL, "commands a client may send in one burst" },
+    { "byte-rate",   &cfg.byte_rate,  NULL, "input bytes per second per client (0 = unlimited)" },
+    { "byte-burst",  &cfg.byte_burst, NULL, "input bytes a client may send in one burst" },
+    { "tick-lines",  &cfg.tick_lines, NULL,
+      "commands run per client per loop pass before others get a turn (0 = no limit)" },
+    { "flood-policy", NULL, &cfg.flood_policy,
+      "throttle|disconnect: what to do when a client exceeds its rates" },
+    { "idle-timeout", &cfg.idle_timeout, NULL, "seconds of silence before the server PINGs (0 = never)" },
+    { "pong-timeout", &cfg.pong_timeout, NULL, "seconds a PINGed client has to answer" },
+    { "nick-timeout", &cfg.nick_timeout, NULL, "seconds a new client has to send NICK (0 = no limit)" },
+    { "metrics-port", &cfg.metrics_port, NULL, "port for HTTP /metrics (0 = off)" },
+    { "metrics-addr", NULL, &cfg.metrics_addr, "address /metrics listens on" },
+    { "admin-local", &cfg.admin_local, NULL,
+      "1 lets clients on 127.0.0.0/8 use STATS (off behind a local proxy!)" },
+};
+
+#define NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+// An immutable, refcounted wire frame (CRLF included). A broadcast is
+// formatted into one frame and every recipient's queue points at it, on
+// every worker, hence the atomic count. Binary-mode recipients get the
+// frame's binary encoding instead, made once on first use.
+typedef struct frame {
+    atomic_uint refs;
+    uint32_t len;                            // bytes in data, CRLF included
+    _Atomic(struct frame *) bin;             // binary encoding, or NULL
+    char data[];
+} frame_t;
+
+// A timer on the worker's timer wheel (see the timers section).
+typedef struct wheel_timer {
+    struct wheel_timer *next, *prev;         // slot list; next is NULL when idle
+    uint64_t due;                            // in wheel ticks
+    void (*fire)(struct wheel_timer *t);
+} wheel_timer_t;
+
+#define CONTAINER_OF(p, type, member) \
+    ((type *)(void *)((char *)(p) - offsetof(type, member)))
+
+typedef struct {
+    // Hot: the fan-out fields, packed into the first cache line (see
+    // cave_client_hot.h). The rest of the record is only read when the
+    // client itself does something.
+    CAVE_CLIENT_HOT_FIELDS
+
+    // cold from here on
+    char nick[CAVE_NICK_MAX];                // username
+    line_ring_t in;                          // leftover input, see client_input_take
+
+    int awaiting;                            // input paused: AWAIT_* bits
+    int admin;                               // may use STATS (see --admin-local)
+
+    // input pacing (see client_admit)
+    uint64_t cmd_tat;                        // when the command bucket is full again, ns
+    uint64_t byte_tat;                       // the same for input bytes
+    uint64_t turn_tick;                      // loop pass turn_lines counts for
+    uint32_t turn_lines;                     // commands run in that pass
+    wheel_timer_t turn_timer;                // AWAIT_TURN until the buckets refill
+
+    // liveness (see client_live_fire), times in ns
+    wheel_timer_t live_timer;
+    uint64_t last_input;                     // when anything was last read
+    uint64_t ping_sent;                      // our PING awaiting an answer, or 0
+    uint64_t nick_due;                       // deadline for NICK, or 0
+
+    // channels joined, and our position in each one's member list
+    struct channel *chans[CAVE_CHANNELS_MAX];
+    uint32_t chan_idx[CAVE_CHANNELS_MAX];
+    uint32_t chan_count;
+
+    // a message going out in MSGPART pieces
+    size_t part_bytes;                       // text sent so far, 0 if none
+    char part_chan[CAVE_CHAN_MAX];           // its channel, "" for everyone
+    int part_skip;                           // dropping the rest of it
+
+    int long_line;                           // LONG_* for the line being read
+    char long_chan[CAVE_CHAN_MAX];           // LONG_MSG: its channel, or ""
+    size_t frame_left;                       // binary: rest of a long frame
+
+#ifdef CAVE_USE_URING
+    struct iovec *send_iov;                  // iovecs of the writev in flight
+    char *held;                              // input that arrived while paused
+    size_t held_len;
+    size_t held_cap;
+    int recv_state;                          // RECV_ARMED etc.
+#endif
+
+    // registry bookkeeping (see client_alloc / client_free)
+    uint32_t slot;                           // index into the slab table
+    uint32_t gen;                            // bumped every time the slot is freed
+    uint32_t live_idx;                       // position in live_clients[]
+    uint32_t next_free;                      // free-list link while unused
+} client_t;
+
+#ifndef CAVE_USE_URING
+_Static_assert(sizeof(client_t) == CAVE_CLIENT_SIZE,
+               "update CAVE_CLIENT_SIZE in cave_client_hot.h");
+#endif
+_Static_assert(offsetof(client_t, nick) <= 64,
+               "client_t hot fields must fit in one cache line");
+
+// ----------------------- client registry -----------------------
+//
+// Clients live in fixed-size slabs that are never moved or freed, so a
+// client_t pointer stays valid for the lifetime of the server. Free slots
+// are kept on an intrusive LIFO list, which makes accept O(1). Anything
+// that outlives a single event (epoll tags, messages from other workers)
+// holds a handle instead of a pointer: the slot index plus the slot's
+// generation, so a handle to a client that has since disconnected simply
+// fails to resolve.
+//
+// Input buffers aren't part of client_t (see the input buffers section),
+// so the records stay small and a fan-out walking them strides over a
+// few hundred bytes per client rather than over 4 KB buffers.
+//
+// Like all per-worker state, the registry is thread-local: each worker
+// thread owns its clients outright and never touches another's.
+
+typedef uint64_t client_handle_t;            // (gen << 32) | slot
+
+#define SLOT_NONE UINT32_MAX
+
+static _Thread_local client_t **client_slabs = NULL;       // slab pointers
+static _Thread_local size_t     client_slab_count = 0;
+static _Thread_local uint32_t   client_free_head = SLOT_NONE;
+
+// Dense list of connected clients, for fan-out without visiting free slots
+static _Thread_local client_t **live_clients = NULL;
+static _Thread_local size_t     live_count = 0;
+static _Thread_local size_t     live_cap = 0;
+
+static client_t *client_slot(uint32_t slot) {
+    return &client_slabs[slot / CLIENT_SLAB_SIZE][slot % CLIENT_SLAB_SIZE];
+}
+
+static client_handle_t client_handle(const client_t *c) {
+    return ((uint64_t)c->gen << 32) | c->slot;
+}
+
+// Resolve a handle, or NULL if that client has gone away since.
+static client_t *client_get(client_handle_t h) {
+    uint32_t slot = (uint32_t)h;
+    if (slot >= client_slab_count * CLIENT_SLAB_SIZE) return NULL;
+
+    client_t *c = client_slot(slot);
+    if (c->fd == -1 || c->gen != (uint32_t)(h >> 32)) return NULL;
+    return c;
+}
+
+// ----------------------- event loop backend -----------------------
+
+#define EV_READ    0x1    // data (or EOF) is waiting
+#define EV_HUP     0x2    // peer hung up or socket error
+#define EV_WRITE   0x4    // socket has room for more output
+
+#define LISTEN_TAG UINT64_MAX       // tag for the listening socket
+#define WAKE_TAG   (UINT64_MAX - 1) // tag for the worker's wakeup pipe
+#define MAX_EVENTS 256          // ready events handled per wakeup
+
+typedef struct {
+    uint64_t tag;          // whatever was passed to loop_add()
+    unsigned events;       // EV_* flags
+} loop_event_t;
+
+#ifdef CAVE_USE_EPOLL
+
+static _Thread_local int epoll_fd = -1;
+
+static int loop_init(void) {
+    epoll_fd = epoll_create1(0);
+    return epoll_fd < 0 ? -1 : 0;
+}
+
+// Client sockets are edge-triggered, so their handlers must read until
+// EAGAIN. The listener stays level-triggered: handle_accept() takes up
+// to --accept-batch connections per wakeup, and whatever is left wakes
+// the next pass, so clients' events in the same wakeup still get served
+// during a connection storm.
+// Edge-triggered sockets are also registered for EPOLLOUT up front; that
+// only fires when the send buffer goes from full to having room, so there
+// is no need to toggle write interest with extra epoll_ctl calls.
+static int loop_add(int fd, uint64_t tag, int edge) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | (edge ? EPOLLOUT | EPOLLET : 0);
+    ev.data.u64 = tag;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void loop_want_write(int fd, int on) {
+    (void)fd;
+    (void)on;
+}
+
+static void loop_del(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Waits for events, or at most timeout_ns (-1 for no limit).
+static int loop_wait(loop_event_t *out, int max, int64_t timeout_ns) {
+    struct epoll_event evs[MAX_EVENTS];
+    if (max > MAX_EVENTS) max = MAX_EVENTS;
+
+    int ms = timeout_ns < 0 ? -1 : (int)((timeout_ns + 999999) / 1000000);
+    int n = epoll_wait(epoll_fd, evs, max, ms);
+    for (int i = 0; i < n; i++) {
+        out[i].tag = evs[i].data.u64;
+        out[i].events = 0;
+        if (evs[i].events & EPOLLIN) out[i].events |= EV_READ;
+        if (evs[i].events & EPOLLOUT) out[i].events |= EV_WRITE;
+        if (evs[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+            out[i].events |= EV_HUP;
+        }
+    }
+    return n;
+}
+
+#elif defined(CAVE_USE_URING)
+
+// io_uring is completion-based, so it doesn't fit loop_wait(): workers
+// run uring_loop() instead (see the workers section). Accept and recv
+// are multishot, recv takes its buffers from a ring provided to the
+// kernel, and every dirty client's writev for the tick is submitted in
+// the same io_uring_enter() that waits for the next completions.
+
+#define URING_ENTRIES   1024
+#define URING_BUFS      1024          // provided recv buffers, power of two
+#define URING_BUF_SIZE  4096
+#define URING_BGID      0
+
+// Input a paused client can receive before its recv is cancelled is
+// bounded by the buffers the kernel had to fill.
+#define HOLD_MAX        (URING_BUFS * URING_BUF_SIZE)
+
+// op in the top byte of user_data; the rest is the tag (client handle)
+enum { UOP_ACCEPT = 1, UOP_WAKE, UOP_RECV, UOP_SEND, UOP_CANCEL };
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;                    // our copy of *sq_tail
+    unsigned unsubmitted;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br;         // provided recv buffers
+    char *bufs;
+    unsigned br_tail;
+
+    int listen_fd, wake_fd;               // to re-arm their multishot ops
+    int accept_armed;                     // the multishot accept is live
+} uring_t;
+
+static _Thread_local uring_t ring;
+
+static uint64_t uring_ud(int op, uint64_t tag) {
+    return ((uint64_t)op << 56) | (tag & 0x00FFFFFFFFFFFFFFull);
+}
+
+static void uring_buf_add(unsigned bid) {
+    struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (URING_BUFS - 1)];
+    b->addr = (uintptr_t)(ring.bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = (uint16_t)bid;
+    ring.br_tail++;
+    __atomic_store_n(&ring.br->tail, (uint16_t)ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_submit(unsigned wait) {
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+    int r = (int)syscall(__NR_io_uring_enter, ring.fd, ring.unsubmitted, wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (r > 0) ring.unsubmitted -= (unsigned)r;
+    return r;
+}
+
+// Submits and waits for a completion, or at most timeout_ns (-1 for no
+// limit; running out of time fails with ETIME).
+static int uring_wait(int64_t timeout_ns) {
+    if (timeout_ns < 0) return uring_submit(1);
+
+    struct __kernel_timespec ts = {
+        timeout_ns / 1000000000, timeout_ns % 1000000000,
+    };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t)&ts;
+
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+    int r = (int)syscall(__NR_io_uring_enter, ring.fd, ring.unsubmitted, 1,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                         &arg, sizeof(arg));
+    if (r > 0) ring.unsubmitted -= (unsigned)r;
+    return r;
+}
+
+static struct io_uring_sqe *uring_sqe(void) {
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sqe_tail - head >= ring.sq_entries) {
+        uring_submit(0);                  // make room
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (ring.sqe_tail - head >= ring.sq_entries) return NULL;
+    }
+
+    unsigned idx = ring.sqe_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    ring.sqe_tail++;
+    ring.unsubmitted++;
+    return sqe;
+}
+
+static int loop_init(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+
+    ring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring.fd < 0) return -1;
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_sz > sq_sz) sq_sz = cq_sz;
+
+    char *sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return -1;
+    char *cq = single ? sq : mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, ring.fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) return -1;
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) return -1;
+
+    ring.sq_head  = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.sqe_tail = *ring.sq_tail;
+    ring.cq_head  = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // recv buffers the kernel picks from; each is handed back once its
+    // completion has been copied into the client's line buffer
+    void *br;
+    if (posix_memalign(&br, 4096, URING_BUFS * sizeof(struct io_uring_buf))) {
+        return -1;
+    }
+    memset(br, 0, URING_BUFS * sizeof(struct io_uring_buf));
+    ring.bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (!ring.bufs) return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring.fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    ring.br = br;
+    for (unsigned i = 0; i < URING_BUFS; i++) uring_buf_add(i);
+    return 0;
+}
+
+static int uring_arm_accept(void) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring.listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_ud(UOP_ACCEPT, 0);
+    ring.accept_armed = 1;
+    return 0;
+}
+
+static int uring_arm_wake(void) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring.wake_fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_ud(UOP_WAKE, 0);
+    return 0;
+}
+
+static int uring_arm_recv(int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_ud(UOP_RECV, tag);
+    return 0;
+}
+
+static int uring_cancel(int op, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_ud(op, tag);
+    sqe->user_data = uring_ud(UOP_CANCEL, 0);
+    return 0;
+}
+
+// iov must stay valid until the UOP_SEND completion arrives.
+static int uring_writev(int fd, uint64_t tag, const struct iovec *iov, int n) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = (unsigned)n;
+    sqe->user_data = uring_ud(UOP_SEND, tag);
+    return 0;
+}
+
+static int loop_add(int fd, uint64_t tag, int edge) {
+    (void)edge;
+    if (tag == LISTEN_TAG) {
+        ring.listen_fd = fd;
+        return uring_arm_accept();
+    }
+    if (tag == WAKE_TAG) {
+        ring.wake_fd = fd;
+        return uring_arm_wake();
+    }
+    return uring_arm_recv(fd, tag);
+}
+
+// The multishot recv holds its own reference to the socket, so close()
+// alone wouldn't end the connection. shutdown() does, and also fails any
+// writev still in flight. There is no loop_want_write(): sends complete
+// on their own.
+static void loop_del(int fd) {
+    shutdown(fd, SHUT_RDWR);
+}
+
+#else // select() fallback
+
+// The master set is maintained incrementally by loop_add/loop_del and
+// copied on each wakeup, instead of being rebuilt from the client table.
+static _Thread_local fd_set   sel_master;
+static _Thread_local fd_set   sel_write;               // fds with queued output
+static _Thread_local uint64_t sel_tags[FD_SETSIZE];
+static _Thread_local int      sel_maxfd = -1;
+
+static int loop_init(void) {
+    FD_ZERO(&sel_master);
+    FD_ZERO(&sel_write);
+    return 0;
+}
+
+static int loop_add(int fd, uint64_t tag, int edge) {
+    (void)edge;              // select() is always level-triggered
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+    FD_SET(fd, &sel_master);
+    sel_tags[fd] = tag;
+    if (fd > sel_maxfd) sel_maxfd = fd;
+    return 0;
+}
+
+static void loop_del(int fd) {
+    if (fd < 0 || fd >= FD_SETSIZE) return;
+    FD_CLR(fd, &sel_master);
+    FD_CLR(fd, &sel_write);
+    while (sel_maxfd >= 0 && !FD_ISSET(sel_maxfd, &sel_master)) {
+        sel_maxfd--;
+    }
+}
+
+// Level-triggered, so write interest is only kept while output is queued.
+static void loop_want_write(int fd, int on) {
+    if (fd < 0 || fd >= FD_SETSIZE) return;
+    if (on) {
+        FD_SET(fd, &sel_write);
+    } else {
+        FD_CLR(fd, &sel_write);
+    }
+}
+
+static int loop_wait(loop_event_t *out, int max, int64_t timeout_ns) {
+    fd_set rfds = sel_master;
+    fd_set wfds = sel_write;
+
+    struct timeval tv = {
+        (time_t)(timeout_ns / 1000000000),
+        (suseconds_t)(timeout_ns % 1000000000 + 999) / 1000,
+    };
+    int ready = select(sel_maxfd + 1, &rfds, &wfds, NULL,
+                       timeout_ns < 0 ? NULL : &tv);
+    if (ready <= 0) return ready;
+
+    int n = 0;
+    for (int fd = 0; fd <= sel_maxfd && n < max; fd++) {
+        unsigned events = 0;
+        if (FD_ISSET(fd, &rfds)) events |= EV_READ;
+        if (FD_ISSET(fd, &wfds)) events |= EV_WRITE;
+        if (events) {
+            out[n].tag = sel_tags[fd];
+            out[n].events = events;
+            n++;
+        }
+    }
+    return n;
+}
+
+#endif // event loop backends
+
+// ----------------------- utility functions -----------------------
+
+static void client_init(client_t *c) {
+    c->fd = -1;
+    c->nick[0] = '\0';
+    line_ring_init(&c->in, NULL, 0);
+    c->out_q = NULL;
+    c->out_head = 0;
+    c->out_count = 0;
+    c->out_cap = 0;
+    c->out_head_off = 0;
+    c->out_bytes = 0;
+    c->out_dropped = 0;
+    c->flush_pending = 0;
+    c->write_blocked = 0;
+    c->closing = 0;
+    c->awaiting = 0;
+    c->binary = 0;
+    c->admin = 0;
+    c->cmd_tat = 0;
+    c->byte_tat = 0;
+    c->turn_tick = 0;
+    c->turn_lines = 0;
+    c->turn_timer.next = NULL;
+    c->live_timer.next = NULL;
+    c->last_input = 0;
+    c->ping_sent = 0;
+    c->nick_due = 0;
+    c->chan_count = 0;
+    c->part_bytes = 0;
+    c->part_chan[0] = '\0';
+    c->part_skip = 0;
+    c->long_line = LONG_NONE;
+    c->long_chan[0] = '\0';
+    c->frame_left = 0;
+#ifdef CAVE_USE_URING
+    c->send_iov = NULL;
+    c->held = NULL;
+    c->held_len = 0;
+    c->held_cap = 0;
+    c->recv_state = RECV_ARMED;              // by loop_add() on accept
+#endif
+}
+
+// Adds one more slab of free slots. Returns -1 if out of memory.
+static int client_grow(void) {
+    client_t **slabs = realloc(client_slabs,
+                               (client_slab_count + 1) * sizeof(*slabs));
+    if (!slabs) return -1;
+    client_slabs = slabs;
+
+    void *mem;
+    if (posix_memalign(&mem, 64, CLIENT_SLAB_SIZE * sizeof(client_t)) != 0) {
+        return -1;
+    }
+    client_t *slab = mem;
+
+    uint32_t base = (uint32_t)(client_slab_count * CLIENT_SLAB_SIZE);
+    client_slabs[client_slab_count++] = slab;
+
+    // push in reverse so the lowest slot is handed out first
+    for (int i = CLIENT_SLAB_SIZE - 1; i >= 0; i--) {
+        client_t *c = &slab[i];
+        client_init(c);
+        c->slot = base + (uint32_t)i;
+        c->gen = 1;
+        c->next_free = client_free_head;
+        client_free_head = c->slot;
+    }
+    return 0;
+}
+
+// Takes a slot off the free list for a freshly accepted socket.
+static client_t *client_alloc(int fd) {
+    if (client_free_head == SLOT_NONE && client_grow() < 0) return NULL;
+
+    if (live_count == live_cap) {
+        size_t cap = live_cap ? live_cap * 2 : CLIENT_SLAB_SIZE;
+        client_t **live = realloc(live_clients, cap * sizeof(*live));
+        if (!live) return NULL;
+        live_clients = live;
+        live_cap = cap;
+    }
+
+    client_t *c = client_slot(client_free_head);
+    client_free_head = c->next_free;
+
+    client_init(c);
+    c->fd = fd;
+    c->next_free = SLOT_NONE;
+    c->live_idx = (uint32_t)live_count;
+    live_clients[live_count++] = c;
+    return c;
+}
+
+// Returns a slot to the free list. Outstanding handles go stale.
+static void client_free(client_t *c) {
+    client_t *last = live_clients[--live_count];
+    live_clients[c->live_idx] = last;
+    last->live_idx = c->live_idx;
+
+    client_init(c);
+    if (++c->gen >= UINT32_MAX - 1) c->gen = 1;   // keep clear of LISTEN_TAG/WAKE_TAG
+    c->next_free = client_free_head;
+    client_free_head = c->slot;
+}
+
+// ----------------------- metrics -----------------------
+//
+// Counters and histograms kept by each worker for its own clients. Only
+// the owning worker writes them, so an update is a plain relaxed load and
+// store, no locked instruction; STATS and /metrics add the workers up with
+// relaxed loads. Histograms have power-of-two buckets: bucket b counts
+// values below 2^b that didn't fit in bucket b - 1.
+
+#define STAT_BUCKETS 32
+#define STAT_VERBS   16                      // command table slots, see cmds[]
+
+typedef _Atomic uint64_t stat_t;
+
+typedef struct {
+    stat_t bucket[STAT_BUCKETS];
+    stat_t count;
+    stat_t sum;
+} stat_hist_t;
+
+typedef struct {
+    stat_t accepted;                         // connections taken on
+    stat_t rejected;                         // turned away with "server full"
+    stat_t throttled;                        // inputs paused by --cmd-rate/--byte-rate
+    stat_t timed_out;                        // closed by the nick or ping timeout
+    stat_t closed;
+    stat_t bytes_in;
+    stat_t bytes_out;
+    stat_t inbuf_bytes;                      // gauge: input buffers attached
+    stat_t commands[STAT_VERBS + 1];         // by cmds[] index, then unknown
+    stat_hist_t command_ns[STAT_VERBS + 1];  // handling time
+    stat_hist_t fanout;                      // local recipients per fan-out
+    stat_hist_t outq;                        // bytes queued when a client is flushed
+} stats_t;
+
+static stats_t stats_unused;                 // for threads that aren't workers
+static _Thread_local stats_t *stats = &stats_unused;
+
+static inline void stat_add(stat_t *s, uint64_t n) {
+    atomic_store_explicit(s, atomic_load_explicit(s, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline void stat_observe(stat_hist_t *h, uint64_t v) {
+    unsigned b = v ? 64u - (unsigned)__builtin_clzll(v) : 0;
+    if (b >= STAT_BUCKETS) b = STAT_BUCKETS - 1;
+    stat_add(&h->bucket[b], 1);
+    stat_add(&h->count, 1);
+    stat_add(&h->sum, v);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// ----------------------- tracing -----------------------
+//
+// Built with -DCAVE_TRACE, the spans marked with TRACE_BEGIN/TRACE_END
+// are kept in a per-worker ring of the last TRACE_EVENTS, and SIGUSR2
+// makes every worker append its ring to TRACE_FILE in Chrome trace
+// format (chrome://tracing or ui.perfetto.dev open it). Without
+// CAVE_TRACE the macros are empty. Each ring is only touched by its own
+// worker, dumps included, so there is no locking until the file.
+
+#ifdef CAVE_TRACE
+
+#define TRACE_EVENTS (1u << 16)              // per worker, a power of two
+#define TRACE_FILE   "cave_trace.json"
+
+typedef struct {
+    const char *name;                        // a string literal or verb
+    uint64_t start;                          // ns, CLOCK_MONOTONIC
+    uint64_t dur;
+} trace_event_t;
+
+typedef struct {
+    trace_event_t ev[TRACE_EVENTS];
+    size_t count;                            // free-running
+    unsigned dumped;                         // last trace_gen written out
+} trace_ring_t;
+
+static _Thread_local trace_ring_t *trace;
+static _Atomic unsigned trace_gen;           // bumped by SIGUSR2
+
+static pthread_mutex_t trace_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned trace_file_gen;              // which dump TRACE_FILE holds
+static size_t trace_file_events;
+
+static void trace_span(const char *name, uint64_t start, uint64_t end) {
+    if (!trace) return;
+    trace_event_t *e = &trace->ev[trace->count++ & (TRACE_EVENTS - 1)];
+    e->name = name;
+    e->start = start;
+    e->dur = end - start;
+}
+
+// Appends this worker's ring to TRACE_FILE if a dump was asked for, and
+// empties it. The first worker to get to a new dump truncates the file.
+static void trace_poll(int tid) {
+    unsigned gen = atomic_load(&trace_gen);
+    if (!trace || trace->dumped == gen) return;
+    trace->dumped = gen;
+
+    pthread_mutex_lock(&trace_file_lock);
+    int fresh = trace_file_gen != gen;
+    FILE *f = fopen(TRACE_FILE, fresh ? "w" : "a");
+    if (!f) {
+        perror(TRACE_FILE);
+        pthread_mutex_unlock(&trace_file_lock);
+        return;
+    }
+    if (fresh) {
+        trace_file_gen = gen;
+        trace_file_events = 0;
+        fputs("[", f);                       // the closing ']' is optional
+    }
+
+    int pid = (int)getpid();
+    fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+               "\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+            trace_file_events ? "," : "", pid, tid, tid);
+    trace_file_events++;
+
+    size_t n = trace->count < TRACE_EVENTS ? trace->count : TRACE_EVENTS;
+    for (size_t i = trace->count - n; i != trace->count; i++) {
+        const trace_event_t *e = &trace->ev[i & (TRACE_EVENTS - 1)];
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                   "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                e->name, (double)e->start / 1e3, (double)e->dur / 1e3, pid, tid);
+    }
+    trace_file_events += n;
+    fclose(f);
+    pthread_mutex_unlock(&trace_file_lock);
+
+    fprintf(stderr, "trace: worker %d wrote %zu events to %s\n", tid, n, TRACE_FILE);
+    trace->count = 0;
+}
+
+#define TRACE_BEGIN(t)          uint64_t t = now_ns()
+#define TRACE_END(t, name)      trace_span((name), (t), now_ns())
+#define TRACE_SPAN(name, s, e)  trace_span((name), (s), (e))
+
+#else
+
+#define TRACE_BEGIN(t)          ((void)0)
+#define TRACE_END(t, name)      ((void)0)
+#define TRACE_SPAN(name, s, e)  ((void)0)
+
+#endif // CAVE_TRACE
+
+// ----------------------- outbound queues -----------------------
+//
+// Sockets are non-blocking. Output is queued as references to frame_t and
+// written at the end of the loop iteration (see flush_dirty_clients);
+// whatever the kernel doesn't take stays queued until the socket reports
+// writable. A client whose queue would grow past cfg.outq_max is a slow
+// consumer and is handled per cfg.slow_policy instead of stalling
+// everyone else.
+//
+// Clients are never freed in the middle of a command, since callers up the
+// stack may still hold the pointer. client_kill() marks them instead and
+// the main loop reaps them once the current batch of events is done.
+
+static _Thread_local client_t **dead_clients = NULL;
+static _Thread_local size_t     dead_count = 0;
+static _Thread_local size_t     dead_cap = 0;
+
+static void client_kill(client_t *c) {
+    if (c->closing) return;
+
+    if (dead_count == dead_cap) {
+        size_t cap = dead_cap ? dead_cap * 2 : 16;
+        client_t **dead = realloc(dead_clients, cap * sizeof(*dead));
+        if (!dead) {
+            // can't defer; at least stop talking to it
+            shutdown(c->fd, SHUT_RDWR);
+            return;
+        }
+        dead_clients = dead;
+        dead_cap = cap;
+    }
+
+    c->closing = 1;
+    dead_clients[dead_count++] = c;
+}
+
+// Builds a frame from a line without its CRLF.
+static frame_t *frame_alloc(size_t len) {
+    frame_t *f = malloc(sizeof(*f) + len);
+    if (!f) return NULL;
+
+    atomic_init(&f->refs, 1);
+    atomic_init(&f->bin, NULL);
+    f->len = (uint32_t)len;
+    return f;
+}
+
+static frame_t *frame_new(const char *line, size_t len) {
+    frame_t *f = frame_alloc(len + 2);
+    if (!f) return NULL;
+
+    memcpy(f->data, line, len);
+    f->data[len] = '\r';
+    f->data[len + 1] = '\n';
+    return f;
+}
+
+// Formats a line the way the handlers used to snprintf into char[BUF_SIZE].
+static frame_t *frame_printf(const char *fmt, ...) {
+    char line[BUF_SIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (n < 0) return NULL;
+    if ((size_t)n >= sizeof(line)) n = sizeof(line) - 1;
+    return frame_new(line, (size_t)n);
+}
+
+static frame_t *frame_ref(frame_t *f) {
+    atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+    return f;
+}
+
+static void frame_unref(frame_t *f) {
+    if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) {
+        frame_t *bin = atomic_load_explicit(&f->bin, memory_order_acquire);
+        if (bin) frame_unref(bin);
+        free(f);
+    }
+}
+
+// Binary framing, negotiated with PROTO BINARY after the WELCOME banner.
+// Each frame, both ways, is a big-endian u16 length and then that many
+// bytes: an opcode, followed by fields that are each a big-endian u16
+// length and the bytes. Opcodes stand for the text verbs, and the fields
+// are the text line's arguments, the trailing ":text" one included, so
+// nothing needs escaping.
+
+enum {
+    OP_WELCOME = 1, OP_PROTO, OP_NICK, OP_MSG, OP_PING, OP_PONG, OP_JOIN,
+    OP_PART, OP_HISTORY, OP_PROFILE, OP_SYS, OP_ERR, OP_MSGPART, OP_STATS,
+    OP_COUNT
+};
+
+static const char *const op_verb[OP_COUNT] = {
+    [OP_WELCOME] = "WELCOME", [OP_PROTO] = "PROTO",     [OP_NICK] = "NICK",
+    [OP_MSG] = "MSG",         [OP_PING] = "PING",       [OP_PONG] = "PONG",
+    [OP_JOIN] = "JOIN",       [OP_PART] = "PART",       [OP_HISTORY] = "HISTORY",
+    [OP_PROFILE] = "PROFILE", [OP_SYS] = "SYS",         [OP_ERR] = "ERR",
+    [OP_MSGPART] = "MSGPART", [OP_STATS] = "STATS",
+};
+
+static unsigned char *put_u16(unsigned char *p, size_t v) {
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+    return p + 2;
+}
+
+// Encodes one text line (no CRLF) at out; returns the bytes written, or
+// 0 if its verb has no opcode.
+static size_t encode_line(unsigned char *out, const char *line, size_t len) {
+    const char *end = line + len;
+    const char *sp = memchr(line, ' ', len);
+    size_t vlen = sp ? (size_t)(sp - line) : len;
+
+    int op = 1;
+    while (op < OP_COUNT && (strlen(op_verb[op]) != vlen ||
+                             memcmp(op_verb[op], line, vlen) != 0)) {
+        op++;
+    }
+    if (op == OP_COUNT) return 0;
+
+    unsigned char *p = out + 2;
+    *p++ = (unsigned char)op;
+    for (const char *q = line + vlen; q < end; ) {
+        q++;                                  // the space
+        const char *arg = q;
+        if (*q == ':') {
+            arg = q + 1;                      // trailing: the rest of the line
+            q = end;
+        } else {
+            while (q < end && *q != ' ') q++;
+        }
+        p = put_u16(p, (size_t)(q - arg));
+        memcpy(p, arg, (size_t)(q - arg));
+        p += q - arg;
+    }
+    put_u16(out, (size_t)(p - out - 2));
+    return (size_t)(p - out);
+}
+
+static frame_t *frame_encode_binary(const frame_t *f) {
+    // each line gains a length and opcode, each argument a length
+    frame_t *b = frame_alloc(f->len * 2 + 4);
+    if (!b) return NULL;
+
+    size_t n = 0;
+    const char *line = f->data;
+    const char *end = f->data + f->len;
+    while (line < end) {
+        const char *crlf = line;
+        while (crlf + 1 < end && !(crlf[0] == '\r' && crlf[1] == '\n')) crlf++;
+        n += encode_line((unsigned char *)b->data + n, line,
+                         (size_t)(crlf - line));
+        line = crlf + 2;
+    }
+    b->len = (uint32_t)n;
+    return b;
+}
+
+// f's binary encoding, made on first use and shared from then on.
+static frame_t *frame_binary(frame_t *f) {
+    frame_t *b = atomic_load_explicit(&f->bin, memory_order_acquire);
+    if (b) return b;
+
+    b = frame_encode_binary(f);
+    if (!b) return NULL;
+
+    frame_t *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&f->bin, &expected, b,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        frame_unref(b);                       // another worker got there first
+        return expected;
+    }
+    return b;
+}
+
+static int out_push(client_t *c, frame_t *f, size_t sent) {
+    if (c->out_count == c->out_cap) {
+        uint32_t cap = c->out_cap ? c->out_cap * 2 : 8;
+        frame_t **q = malloc(cap * sizeof(*q));
+        if (!q) return -1;
+
+        // unwrap the old ring into the front of the new one
+        for (uint32_t i = 0; i < c->out_count; i++) {
+            q[i] = c->out_q[(c->out_head + i) & (c->out_cap - 1)];
+        }
+        free(c->out_q);
+        c->out_q = q;
+        c->out_head = 0;
+        c->out_cap = cap;
+    }
+
+    if (c->out_count == 0) c->out_head_off = sent;
+    c->out_q[(c->out_head + c->out_count) & (c->out_cap - 1)] = frame_ref(f);
+    c->out_count++;
+    c->out_bytes += f->len - sent;
+    return 0;
+}
+
+static void out_pop(client_t *c) {
+    frame_unref(c->out_q[c->out_head]);
+    c->out_head = (c->out_head + 1) & (c->out_cap - 1);
+    c->out_count--;
+    c->out_head_off = 0;
+}
+
+// Drops everything still queued (the connection is going away).
+static void out_clear(client_t *c) {
+    while (c->out_count) out_pop(c);
+    free(c->out_q);
+    c->out_q = NULL;
+    c->out_cap = 0;
+    c->out_bytes = 0;
+}
+
+static void send_line(client_t *c, const char *line);
+
+// Fills iov from the front of the queue; returns the count, and the byte
+// total through *total.
+static int out_fill_iov(client_t *c, struct iovec *iov, size_t *total) {
+    int n = 0;
+    *total = 0;
+    for (uint32_t i = 0; i < c->out_count && n < FLUSH_IOV; i++) {
+        frame_t *f = c->out_q[(c->out_head + i) & (c->out_cap - 1)];
+        size_t off = (i == 0) ? c->out_head_off : 0;
+        iov[n].iov_base = f->data + off;
+        iov[n].iov_len = f->len - off;
+        *total += iov[n].iov_len;
+        n++;
+    }
+    return n;
+}
+
+// Releases the first n bytes of the queue after the kernel took them.
+static void out_consume(client_t *c, size_t n) {
+    c->out_bytes -= n;
+    while (n > 0) {
+        frame_t *f = c->out_q[c->out_head];
+        size_t rest = f->len - c->out_head_off;
+        if (n < rest) {
+            c->out_head_off += n;
+            return;
+        }
+        n -= rest;
+        out_pop(c);
+    }
+}
+
+// Too much queued to wait for the end of the tick.
+static int out_backlogged(const client_t *c) {
+    return c->out_bytes >= FLUSH_EAGER ||
+           c->out_bytes * 2 >= (size_t)cfg.outq_max;
+}
+
+// The queue just emptied; tell a SLOW_DROP client what it missed.
+static void out_drained(client_t *c) {
+    if (c->out_dropped) {
+        char note[96];
+        snprintf(note, sizeof(note),
+                 "SYS :%lu messages dropped (connection too slow)",
+                 c->out_dropped);
+        c->out_dropped = 0;
+        send_line(c, note);
+    }
+}
+
+#ifdef CAVE_USE_URING
+
+// One writev in flight per client, from c->send_iov; write_blocked marks
+// it busy until client_send_done() sees the completion. A backlog is
+// written straight away first, as far as the socket takes it, so a burst
+// isn't held back waiting on a completion.
+static void client_flush(client_t *c) {
+    if (c->closing || c->write_blocked) return;
+
+    while (c->out_count && out_backlogged(c)) {
+        struct iovec iov[FLUSH_IOV];
+        size_t total;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)out_fill_iov(c, iov, &total);
+
+        ssize_t w = sendmsg(c->fd, &msg, MSG_DONTWAIT);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            client_kill(c);
+            return;
+        }
+        stat_add(&stats->bytes_out, (uint64_t)w);
+
+        out_consume(c, (size_t)w);
+        if ((size_t)w < total) break;
+    }
+
+    if (c->out_count == 0) {
+        out_drained(c);
+        return;
+    }
+
+    if (!c->send_iov) {
+        c->send_iov = malloc(FLUSH_IOV * sizeof(*c->send_iov));
+        if (!c->send_iov) {
+            client_kill(c);
+            return;
+        }
+    }
+
+    size_t total;
+    int n = out_fill_iov(c, c->send_iov, &total);
+    if (uring_writev(c->fd, client_handle(c), c->send_iov, n) < 0) {
+        client_kill(c);
+        return;
+    }
+    c->write_blocked = 1;
+}
+
+#else
+
+// Hands the queue to the kernel with as few writev() calls as possible.
+// If the socket fills up, the rest waits for EV_WRITE.
+static void client_flush(client_t *c) {
+    if (c->closing) return;
+
+    while (c->out_count) {
+        struct iovec iov[FLUSH_IOV];
+        size_t total;
+        int n = out_fill_iov(c, iov, &total);
+
+        ssize_t w = writev(c->fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) w = 0;
+            else {
+                client_kill(c);
+                return;
+            }
+        }
+
+        stat_add(&stats->bytes_out, (uint64_t)w);
+        out_consume(c, (size_t)w);
+
+        if ((size_t)w < total) {
+            c->write_blocked = 1;
+            loop_want_write(c->fd, 1);
+            return;
+        }
+    }
+
+    if (c->write_blocked) {
+        c->write_blocked = 0;
+        loop_want_write(c->fd, 0);
+    }
+
+    out_drained(c);
+}
+
+#endif // CAVE_USE_URING
+
+// Clients with output queued during this loop iteration. They are flushed
+// together at the end of the tick, so a command that answers with several
+// lines (or a burst of broadcasts) costs one writev per socket.
+static _Thread_local client_t **flush_list = NULL;
+static _Thread_local size_t     flush_count = 0;
+static _Thread_local size_t     flush_cap = 0;
+
+static void mark_dirty(client_t *c) {
+    if (c->flush_pending || c->write_blocked) return;
+
+    if (flush_count == flush_cap) {
+        size_t cap = flush_cap ? flush_cap * 2 : 64;
+        client_t **list = realloc(flush_list, cap * sizeof(*list));
+        if (!list) {
+            client_flush(c);            // can't defer, write it now
+            return;
+        }
+        flush_list = list;
+        flush_cap = cap;
+    }
+
+    c->flush_pending = 1;
+    flush_list[flush_count++] = c;
+}
+
+static void flush_dirty_clients(void) {
+    if (flush_count == 0) return;
+    TRACE_BEGIN(t);
+
+    // client_flush may queue a drop notice, which can extend the list
+    for (size_t i = 0; i < flush_count; i++) {
+        client_t *c = flush_list[i];
+        c->flush_pending = 0;
+        stat_observe(&stats->outq, c->out_bytes);
+        if (!c->write_blocked) client_flush(c);
+    }
+    flush_count = 0;
+    TRACE_END(t, "flush");
+}
+
+// Queues a reference to f for c. The caller keeps its own reference.
+static void send_frame(client_t *c, frame_t *f) {
+    if (c->closing) return;
+
+    if (c->binary) {
+        f = frame_binary(f);
+        if (!f) {
+            client_kill(c);
+            return;
+        }
+    }
+
+    if (c->out_count > 0 && c->out_bytes + f->len > (size_t)cfg.outq_max) {
+        if (cfg.slow_mode == SLOW_DROP) {
+            c->out_dropped++;
+        } else {
+            client_kill(c);
+        }
+        return;
+    }
+
+    if (out_push(c, f, 0) < 0) {
+        client_kill(c);
+        return;
+    }
+
+    // don't let one burst pile up until the end of the tick
+    if (out_backlogged(c) && !c->write_blocked) {
+        client_flush(c);
+    } else {
+        mark_dirty(c);
+    }
+}
+
+static void send_line(client_t *c, const char *line) {
+    if (c->closing) return;
+
+    frame_t *f = frame_new(line, strlen(line));
+    if (!f) {
+        client_kill(c);
+        return;
+    }
+    send_frame(c, f);
+    frame_unref(f);
+}
+
+// Disconnects c, trying to get line and anything queued before it out
+// first.
+static void client_kill_with(client_t *c, const char *line) {
+    send_line(c, line);
+    if (!c->write_blocked) client_flush(c);
+#ifdef CAVE_USE_URING
+    uring_submit(0);                 // before the shutdown, not after
+#endif
+    client_kill(c);
+}
+
+// Sends f to every client on this worker except from.
+static void fanout_local(client_t *from, frame_t *f) {
+    stat_observe(&stats->fanout, live_count);
+    for (size_t i = 0; i < live_count; i++) {
+        if (live_clients[i] != from) {
+            send_frame(live_clients[i], f);
+        }
+    }
+}
+
+static void broadcast_frame(client_t *from, frame_t *f, int keep);
+
+static void broadcast_line(client_t *from, const char *line) {
+    frame_t *f = frame_new(line, strlen(line));
+    if (!f) return;
+    broadcast_frame(from, f, 0);
+    frame_unref(f);
+}
+
+// Turns away a socket that never made it into the registry: one
+// non-blocking send of a constant line, then close. Best effort only.
+static void reject_full(int fd) {
+    static const char line[] = "ERR :server full\r\n";
+    ssize_t r = send(fd, line, sizeof(line) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)r;
+    close(fd);
+}
+
+// ----------------------- input buffers -----------------------
+//
+// Most reads end on a line boundary, so a client only keeps input
+// between reads when a line is cut off or it is paused with lines still
+// to run. Reads land in the worker's in_scratch, behind whatever was left
+// over last time (client_input_take), and what's left afterwards is
+// copied out to the smallest pooled buffer that holds it
+// (client_input_put). An idle client holds no buffer at all.
+//
+// Pooled buffers come in power-of-two sizes from INBUF_MIN to BUF_SIZE,
+// each size with its own free list, which keeps up to INBUF_KEEP spares.
+
+#define INBUF_MIN     128
+#define INBUF_CLASSES 6                      // INBUF_MIN << 0 .. BUF_SIZE
+#define INBUF_KEEP    256
+
+_Static_assert((INBUF_MIN << (INBUF_CLASSES - 1)) == BUF_SIZE,
+               "the largest input buffer class must be BUF_SIZE");
+
+typedef struct inbuf {
+    struct inbuf *next;                      // free-list link
+} inbuf_t;
+
+static _Thread_local char      in_scratch[BUF_SIZE];
+static _Thread_local inbuf_t  *inbuf_free[INBUF_CLASSES];
+static _Thread_local size_t    inbuf_spare[INBUF_CLASSES];
+
+static int inbuf_class(size_t n) {
+    int k = 0;
+    while (((size_t)INBUF_MIN << k) < n) k++;
+    return k;
+}
+
+static char *inbuf_get(int k) {
+    inbuf_t *b = inbuf_free[k];
+    if (b) {
+        inbuf_free[k] = b->next;
+        inbuf_spare[k]--;
+    } else {
+        b = malloc((size_t)INBUF_MIN << k);
+        if (!b) return NULL;
+    }
+    stat_add(&stats->inbuf_bytes, (uint64_t)INBUF_MIN << k);
+    return (char *)b;
+}
+
+static void inbuf_put(char *buf, size_t size) {
+    int k = inbuf_class(size);
+    stat_add(&stats->inbuf_bytes, -(uint64_t)size);
+    if (inbuf_spare[k] >= INBUF_KEEP) {
+        free(buf);
+        return;
+    }
+    inbuf_t *b = (inbuf_t *)(void *)buf;
+    b->next = inbuf_free[k];
+    inbuf_free[k] = b;
+    inbuf_spare[k]++;
+}
+
+// Copies the first len bytes of r to the start of dst and points r at it.
+static void line_ring_move(line_ring_t *r, char *dst, size_t cap) {
+    size_t len = line_ring_len(r);
+    size_t scanned = r->scanned;
+    const char *p = len ? line_ring_peek(r, len, dst) : dst;
+    if (p != dst) memcpy(dst, p, len);
+
+    line_ring_init(r, dst, cap);
+    r->tail = len;
+    r->scanned = scanned;
+}
+
+// Before reading or running c's input: moves what was left over, if
+// anything, into in_scratch and gives the pooled buffer back.
+static void client_input_take(client_t *c) {
+    char *buf = c->in.buf;
+    size_t cap = c->in.cap;
+    if (buf == in_scratch) return;
+
+    line_ring_move(&c->in, in_scratch, BUF_SIZE);
+    if (buf) inbuf_put(buf, cap);
+}
+
+// After reading or running c's input: copies what's left to a pooled
+// buffer, so in_scratch is free for the next client.
+static void client_input_put(client_t *c) {
+    if (c->in.buf != in_scratch) return;
+
+    size_t len = line_ring_len(&c->in);
+    if (len == 0 || c->closing) {
+        line_ring_init(&c->in, NULL, 0);
+        return;
+    }
+
+    int k = inbuf_class(len);
+    char *buf = inbuf_get(k);
+    if (!buf) {
+        line_ring_init(&c->in, NULL, 0);
+        client_kill(c);
+        return;
+    }
+    line_ring_move(&c->in, buf, (size_t)INBUF_MIN << k);
+}
+
+static void client_input_drop(client_t *c) {
+    if (c->in.buf && c->in.buf != in_scratch) inbuf_put(c->in.buf, c->in.cap);
+    line_ring_init(&c->in, NULL, 0);
+}
+
+// ----------------------- message history -----------------------
+//
+// The last cfg.history chat frames, globally and per channel, kept as
+// references to the frames that were sent; HISTORY queues the same
+// frames again. Every worker keeps its own copy of the global history
+// (each sees every broadcast). A channel's history is kept only by its
+// home worker (see chan_home).
+
+typedef struct {
+    frame_t **frames;                        // ring of cfg.history, on first use
+    uint32_t head;                           // oldest
+    uint32_t count;
+} history_t;
+
+static _Thread_local history_t global_history;
+
+static void history_add(history_t *h, frame_t *f) {
+    uint32_t cap = (uint32_t)cfg.history;
+    if (cap == 0) return;
+    if (!h->frames) {
+        h->frames = malloc(cap * sizeof(*h->frames));
+        if (!h->frames) return;
+    }
+
+    if (h->count == cap) {
+        frame_unref(h->frames[h->head]);
+        h->frames[h->head] = frame_ref(f);
+        h->head = (h->head + 1) % cap;
+        return;
+    }
+    h->frames[(h->head + h->count) % cap] = frame_ref(f);
+    h->count++;
+}
+
+static void history_clear(history_t *h) {
+    for (uint32_t i = 0; i < h->count; i++) {
+        frame_unref(h->frames[(h->head + i) % (uint32_t)cfg.history]);
+    }
+    free(h->frames);
+    h->frames = NULL;
+    h->head = 0;
+    h->count = 0;
+}
+
+// Queues the newest n frames (oldest first).
+static void history_replay(client_t *c, const history_t *h, uint32_t n) {
+    if (n > h->count) n = h->count;
+    uint32_t start = h->head + h->count - n;
+    for (uint32_t i = 0; i < n; i++) {
+        send_frame(c, h->frames[(start + i) % (uint32_t)cfg.history]);
+    }
+}
+
+// ----------------------- workers -----------------------
+//
+// With --threads N the server runs N workers. Each has its own listener
+// (SO_REUSEPORT lets the kernel spread new connections across them), its
+// own event loop and its own clients. Workers never touch each other's
+// state; anything that crosses shards is an xmsg_t pushed onto the
+// owning worker's inbox, a lock-free multi-producer/single-consumer queue
+// (Vyukov's intrusive design). A self-pipe in each loop wakes the owner,
+// and only the first push after it last drained pays for the write().
+
+typedef enum {
+    XMSG_BROADCAST,         // deliver frame to every client on this worker
+    XMSG_REPLY,             // deliver frames, then frame, to one paused client, resume it
+    XMSG_NICK_CLAIM,        // (nick partition) claim nick for worker/client
+    XMSG_NICK_RESULT,       // (owner) outcome of a claim, in ok
+    XMSG_NICK_RELEASE,      // (nick partition) drop nick if worker/client holds it
+    XMSG_PROFILE_QUERY,     // (nick partition) is nick online? reply
+    XMSG_CHANNEL,           // deliver frame to this worker's members of chan
+    XMSG_HISTORY_QUERY,     // (chan home) reply with the last count frames of chan
+    XMSG_NICK_RESTORE,      // (nick partition) claim nick, no answer (hot upgrade)
+} xmsg_type_t;
+
+typedef struct xmsg {
+    _Atomic(struct xmsg *) next;             // inbox link
+    xmsg_type_t type;
+    int worker;                              // requesting worker...
+    client_handle_t client;                  // ...and client on it
+    int ok;                                  // NICK_RESULT
+    int keep;                                // BROADCAST / CHANNEL: add to history
+    uint32_t count;                          // HISTORY_QUERY: frames wanted
+    frame_t *frame;                          // BROADCAST / REPLY / CHANNEL
+    frame_t **frames;                        // REPLY: sent ahead of frame
+    uint32_t nframes;
+    char nick[CAVE_NICK_MAX];
+    char chan[CAVE_CHAN_MAX];                // CHANNEL
+} xmsg_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int listen_fd;
+    int wake_rd, wake_wr;                    // self-pipe watched by the loop
+    atomic_int wake_pending;                 // a wakeup byte is in the pipe
+
+    _Atomic(xmsg_t *) inbox_tail;            // producers swap themselves in here
+    xmsg_t *inbox_head;                      // consumer side, owner only
+    xmsg_t inbox_stub;
+
+    // messages this worker posted and handled, for the hot upgrade to
+    // tell when none are in flight (see upgrade_settled())
+    stat_t xmsg_posted;
+    stat_t xmsg_done;
+    atomic_int upgrade_ready;                // paused, nothing of ours in flight
+
+    stats_t stats;                           // written by this worker only
+} worker_t;
+
+static worker_t *workers = NULL;
+static int       worker_count = 1;
+
+static _Thread_local worker_t *self;         // the worker running this thread
+
+static void inbox_init(worker_t *w) {
+    atomic_init(&w->inbox_stub.next, NULL);
+    atomic_init(&w->inbox_tail, &w->inbox_stub);
+    w->inbox_head = &w->inbox_stub;
+}
+
+static void inbox_push(worker_t *w, xmsg_t *m) {
+    atomic_store_explicit(&m->next, NULL, memory_order_relaxed);
+    xmsg_t *prev = atomic_exchange_explicit(&w->inbox_tail, m,
+                                            memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, m, memory_order_release);
+}
+
+// Returns NULL when empty, or when a producer is halfway through a push;
+// that producer's wakeup brings us back for it.
+static xmsg_t *inbox_pop(worker_t *w) {
+    xmsg_t *head = w->inbox_head;
+    xmsg_t *next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+    if (head == &w->inbox_stub) {
+        if (!next) return NULL;
+        w->inbox_head = next;
+        head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
+    if (next) {
+        w->inbox_head = next;
+        return head;
+    }
+
+    if (head != atomic_load_explicit(&w->inbox_tail, memory_order_acquire)) {
+        return NULL;
+    }
+    inbox_push(w, &w->inbox_stub);
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (next) {
+        w->inbox_head = next;
+        return head;
+    }
+    return NULL;
+}
+
+static xmsg_t *xmsg_new(xmsg_type_t type) {
+    xmsg_t *m = calloc(1, sizeof(*m));
+    if (m) m->type = type;
+    return m;
+}
+
+// Hands m to another worker (or to ourselves, for the next wakeup).
+static void post(int worker, xmsg_t *m) {
+    worker_t *w = &workers[worker];
+    stat_add(&self->xmsg_posted, 1);
+    inbox_push(w, m);
+    if (!atomic_exchange(&w->wake_pending, 1)) {
+        char b = 1;
+        ssize_t r = write(w->wake_wr, &b, 1);
+        (void)r;                 // pipe full means a wakeup is already due
+    }
+}
+
+// Local fan-out, plus one message per other worker carrying the same
+// frame. keep adds it to the global history everywhere.
+static void broadcast_frame(client_t *from, frame_t *f, int keep) {
+    TRACE_BEGIN(t);
+    fanout_local(from, f);
+    if (keep) history_add(&global_history, f);
+
+    for (int i = 0; i < worker_count; i++) {
+        if (i == self->id) continue;
+        xmsg_t *m = xmsg_new(XMSG_BROADCAST);
+        if (!m) continue;
+        m->frame = frame_ref(f);
+        m->keep = keep;
+        post(i, m);
+    }
+    TRACE_END(t, "broadcast");
+}
+
+// Sends a reply to a client paused on another worker.
+static void post_reply(xmsg_t *m, frame_t *f) {
+    int worker = m->worker;
+    m->type = XMSG_REPLY;
+    m->frame = f;
+    post(worker, m);
+}
+
+// ----------------------- nick index -----------------------
+//
+// Open-addressing hash table (linear probing) from nick to owner, kept at
+// most half full. Removal shifts the rest of the probe run back instead of
+// leaving tombstones, so lookups never have to step over dead entries.
+//
+// The nick namespace is partitioned across workers by hash: worker
+// nick_partition(n) holds the only entry for n, naming the worker and
+// client that own it. Claims, releases and lookups for a nick in another
+// partition go through that worker's inbox.
+
+typedef struct {
+    char nick[CAVE_NICK_MAX];
+    uint32_t hash;
+    int worker;                              // owner's worker, -1 if slot empty
+    client_handle_t owner;
+} nick_entry_t;
+
+static _Thread_local nick_entry_t *nick_table = NULL;
+static _Thread_local size_t nick_table_cap = 0;     // always a power of two
+static _Thread_local size_t nick_table_count = 0;
+
+// FNV-1a
+static uint32_t nick_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int nick_partition(const char *nick) {
+    return (int)(nick_hash(nick) % (uint32_t)worker_count);
+}
+
+static void nick_table_place(nick_entry_t *table, size_t cap,
+                             const nick_entry_t *e) {
+    size_t mask = cap - 1;
+    size_t i = e->hash & mask;
+    while (table[i].worker != -1) i = (i + 1) & mask;
+    table[i] = *e;
+}
+
+static int nick_table_grow(void) {
+    size_t cap = nick_table_cap ? nick_table_cap * 2 : 64;
+    nick_entry_t *table = malloc(cap * sizeof(*table));
+    if (!table) return -1;
+    for (size_t i = 0; i < cap; i++) table[i].worker = -1;
+
+    for (size_t i = 0; i < nick_table_cap; i++) {
+        if (nick_table[i].worker != -1) {
+            nick_table_place(table, cap, &nick_table[i]);
+        }
+    }
+    free(nick_table);
+    nick_table = table;
+    nick_table_cap = cap;
+    return 0;
+}
+
+// Find a nick's entry in this worker's partition (exact match)
+static nick_entry_t *nick_index_find(const char *nick) {
+    if (nick_table_count == 0) return NULL;
+
+    uint32_t h = nick_hash(nick);
+    size_t mask = nick_table_cap - 1;
+    for (size_t i = h & mask; nick_table[i].worker != -1; i = (i + 1) & mask) {
+        nick_entry_t *e = &nick_table[i];
+        if (e->hash == h && strcmp(e->nick, nick) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Returns 1 if nick now belongs to worker/owner (or already did), 0 if
+// someone else holds it, -1 if out of memory.
+static int nick_index_claim(const char *nick, int worker, client_handle_t owner) {
+    nick_entry_t *e = nick_index_find(nick);
+    if (e) return e->worker == worker && e->owner == owner;
+
+    if ((nick_table_count + 1) * 2 > nick_table_cap && nick_table_grow() < 0) {
+        return -1;
+    }
+
+    nick_entry_t ne;
+    snprintf(ne.nick, sizeof(ne.nick), "%s", nick);
+    ne.hash = nick_hash(nick);
+    ne.worker = worker;
+    ne.owner = owner;
+    nick_table_place(nick_table, nick_table_cap, &ne);
+    nick_table_count++;
+    return 1;
+}
+
+static void nick_index_release(const char *nick, int worker,
+                               client_handle_t owner) {
+    nick_entry_t *e = nick_index_find(nick);
+    if (!e || e->worker != worker || e->owner != owner) return;
+
+    size_t mask = nick_table_cap - 1;
+    size_t hole = (size_t)(e - nick_table);
+
+    // pull back any later entry whose home slot is at or before the hole
+    for (size_t j = (hole + 1) & mask; nick_table[j].worker != -1;
+         j = (j + 1) & mask) {
+        size_t home = nick_table[j].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            nick_table[hole] = nick_table[j];
+            hole = j;
+        }
+    }
+    nick_table[hole].worker = -1;
+    nick_table_count--;
+}
+
+// Gives up c's current nick, wherever its partition lives.
+static void nick_release_for(client_t *c) {
+    int p = nick_partition(c->nick);
+    if (p == self->id) {
+        nick_index_release(c->nick, self->id, client_handle(c));
+        return;
+    }
+
+    xmsg_t *m = xmsg_new(XMSG_NICK_RELEASE);
+    if (!m) return;
+    m->worker = self->id;
+    m->client = client_handle(c);
+    snprintf(m->nick, sizeof(m->nick), "%s", c->nick);
+    post(p, m);
+}
+
+// ----------------------- channels -----------------------
+//
+// Each worker keeps its own table of the channels its clients are in, with
+// a dense member vector per channel, so channel fan-out only visits
+// members. A channel exists on a worker while it has members there, and
+// on its home worker also while it has history. Channel traffic goes to
+// the local members plus one XMSG_CHANNEL per other worker, which
+// delivers it to its own members, if any.
+//
+// A worker keeps at most cfg.max_channels channels. Past that, a new one
+// pushes out the least recently used channel that only has history left,
+// so channels made and abandoned in a loop can't pile up.
+
+typedef struct channel {
+    char name[CAVE_CHAN_MAX];
+    uint32_t hash;
+    client_t **members;                      // this worker's members only
+    uint32_t count;
+    uint32_t cap;
+    history_t history;                       // on the home worker only
+    uint64_t last_used;                      // chan_clock when last created or sent to
+} channel_t;
+
+// open addressing, same scheme as the nick index
+static _Thread_local channel_t **chan_table = NULL;
+static _Thread_local size_t chan_table_cap = 0;     // always a power of two
+static _Thread_local size_t chan_table_count = 0;
+static _Thread_local uint64_t chan_clock = 0;       // counts channel uses, for eviction
+
+// '#' then printable characters, no spaces, commas or colons
+static int channel_name_ok(const char *name) {
+    size_t len = strlen(name);
+    if (len < 2 || len >= CAVE_CHAN_MAX || name[0] != '#') return 0;
+    for (size_t i = 1; i < len; i++) {
+        unsigned char ch = (unsigned char)name[i];
+        if (ch <= ' ' || ch >= 0x7f || ch == ',' || ch == ':') return 0;
+    }
+    return 1;
+}
+
+// The worker that keeps the channel's history.
+static int chan_home(const char *name) {
+    return (int)(nick_hash(name) % (uint32_t)worker_count);
+}
+
+static void chan_table_place(channel_t **table, size_t cap, channel_t *ch) {
+    size_t mask = cap - 1;
+    size_t i = ch->hash & mask;
+    while (table[i]) i = (i + 1) & mask;
+    table[i] = ch;
+}
+
+static int chan_table_grow(void) {
+    size_t cap = chan_table_cap ? chan_table_cap * 2 : 64;
+    channel_t **table = calloc(cap, sizeof(*table));
+    if (!table) return -1;
+
+    for (size_t i = 0; i < chan_table_cap; i++) {
+        if (chan_table[i]) chan_table_place(table, cap, chan_table[i]);
+    }
+    free(chan_table);
+    chan_table = table;
+    chan_table_cap = cap;
+    return 0;
+}
+
+static channel_t *channel_find(const char *name) {
+    if (chan_table_count == 0) return NULL;
+
+    uint32_t h = nick_hash(name);
+    size_t mask = chan_table_cap - 1;
+    for (size_t i = h & mask; chan_table[i]; i = (i + 1) & mask) {
+        channel_t *ch = chan_table[i];
+        if (ch->hash == h && strcmp(ch->name, name) == 0) return ch;
+    }
+    return NULL;
+}
+
+static void channel_destroy(channel_t *ch);
+
+// Drops the least recently used channel without members here, history
+// and all. Returns -1 if every channel has members.
+static int channel_evict(void) {
+    channel_t *victim = NULL;
+    for (size_t i = 0; i < chan_table_cap; i++) {
+        channel_t *ch = chan_table[i];
+        if (ch && ch->count == 0 &&
+            (!victim || ch->last_used < victim->last_used)) {
+            victim = ch;
+        }
+    }
+    if (!victim) return -1;
+    channel_destroy(victim);
+    return 0;
+}
+
+// NULL if out of memory, or if the worker is at cfg.max_channels and
+// every channel has members.
+static channel_t *channel_create(const char *name) {
+    if (chan_table_count >= (size_t)cfg.max_channels && channel_evict() < 0) {
+        return NULL;
+    }
+    if ((chan_table_count + 1) * 2 > chan_table_cap && chan_table_grow() < 0) {
+        return NULL;
+    }
+
+    channel_t *ch = calloc(1, sizeof(*ch));
+    if (!ch) return NULL;
+    snprintf(ch->name, sizeof(ch->name), "%s", name);
+    ch->hash = nick_hash(name);
+    ch->last_used = ++chan_clock;
+    chan_table_place(chan_table, chan_table_cap, ch);
+    chan_table_count++;
+    return ch;
+}
+
+// Drops a channel from this worker's table.
+static void channel_destroy(channel_t *ch) {
+    size_t mask = chan_table_cap - 1;
+    size_t hole = ch->hash & mask;
+    while (chan_table[hole] != ch) hole = (hole + 1) & mask;
+
+    for (size_t j = (hole + 1) & mask; chan_table[j]; j = (j + 1) & mask) {
+        size_t home = chan_table[j]->hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            chan_table[hole] = chan_table[j];
+            hole = j;
+        }
+    }
+    chan_table[hole] = NULL;
+    chan_table_count--;
+
+    history_clear(&ch->history);
+    free(ch->members);
+    free(ch);
+}
+
+// Position of ch in c->chans, or -1.
+static int client_chan_find(const client_t *c, const char *name) {
+    for (uint32_t i = 0; i < c->chan_count; i++) {
+        if (strcmp(c->chans[i]->name, name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+static int channel_add(channel_t *ch, client_t *c) {
+    if (ch->count == ch->cap) {
+        uint32_t cap = ch->cap ? ch->cap * 2 : 8;
+        client_t **members = realloc(ch->members, cap * sizeof(*members));
+        if (!members) return -1;
+        ch->members = members;
+        ch->cap = cap;
+    }
+
+    c->chans[c->chan_count] = ch;
+    c->chan_idx[c->chan_count] = ch->count;
+    c->chan_count++;
+    ch->members[ch->count++] = c;
+    return 0;
+}
+
+// Takes c out of its i-th channel; the last member fills the gap.
+static void channel_remove(client_t *c, uint32_t i) {
+    channel_t *ch = c->chans[i];
+    uint32_t idx = c->chan_idx[i];
+
+    client_t *last = ch->members[--ch->count];
+    if (last != c) {
+        ch->members[idx] = last;
+        last->chan_idx[client_chan_find(last, ch->name)] = idx;
+    }
+
+    c->chan_count--;
+    c->chans[i] = c->chans[c->chan_count];
+    c->chan_idx[i] = c->chan_idx[c->chan_count];
+
+    if (ch->count == 0 && ch->history.count == 0) channel_destroy(ch);
+}
+
+static void channel_fanout_local(channel_t *ch, frame_t *f) {
+    stat_observe(&stats->fanout, ch->count);
+    for (uint32_t i = 0; i < ch->count; i++) {
+        send_frame(ch->members[i], f);
+    }
+}
+
+// Delivers f to every member of the channel, on every worker. keep adds
+// it to the channel's history at its home.
+static void channel_send(channel_t *ch, frame_t *f, int keep) {
+    ch->last_used = ++chan_clock;
+    channel_fanout_local(ch, f);
+    if (keep && chan_home(ch->name) == self->id) history_add(&ch->history, f);
+
+    for (int i = 0; i < worker_count; i++) {
+        if (i == self->id) continue;
+        xmsg_t *m = xmsg_new(XMSG_CHANNEL);
+        if (!m) continue;
+        m->frame = frame_ref(f);
+        m->keep = keep;
+        snprintf(m->chan, sizeof(m->chan), "%s", ch->name);
+        post(i, m);
+    }
+}
+
+static void handle_join(client_t *c, const char *name) {
+    if (!channel_name_ok(name)) {
+        send_line(c, "ERR :bad channel name");
+        return;
+    }
+    if (client_chan_find(c, name) >= 0) {
+        send_line(c, "ERR :already in channel");
+        return;
+    }
+    if (c->chan_count == CAVE_CHANNELS_MAX) {
+        send_line(c, "ERR :too many channels");
+        return;
+    }
+
+    channel_t *ch = channel_find(name);
+    if (!ch) ch = channel_create(name);
+    if (!ch) {
+        send_line(c, chan_table_count >= (size_t)cfg.max_channels
+                         ? "ERR :too many channels on the server"
+                         : "ERR :out of memory");
+        return;
+    }
+    if (channel_add(ch, c) < 0) {
+        if (ch->count == 0 && ch->history.count == 0) channel_destroy(ch);
+        send_line(c, "ERR :out of memory");
+        return;
+    }
+
+    frame_t *f = frame_printf("JOIN %s @%s", name,
+                              c->nick[0] ? c->nick : "anon");
+    if (!f) return;
+    channel_send(ch, f, 0);
+    frame_unref(f);
+}
+
+static void handle_part(client_t *c, const char *name) {
+    int i = client_chan_find(c, name);
+    if (i < 0) {
+        send_line(c, "ERR :not in channel");
+        return;
+    }
+
+    // announce first, so the leaver sees it too
+    frame_t *f = frame_printf("PART %s @%s", name,
+                              c->nick[0] ? c->nick : "anon");
+    if (f) {
+        channel_send(c->chans[i], f, 0);
+        frame_unref(f);
+    }
+    channel_remove(c, (uint32_t)i);
+}
+
+static frame_t *history_end_frame(const char *chan) {
+    return chan[0] ? frame_printf("HISTORY END %s", chan)
+                   : frame_printf("HISTORY END");
+}
+
+// HISTORY [#chan] [n]; name is "" for the global history, count NULL
+// for all of it.
+static void handle_history(client_t *c, const char *name, const char *count) {
+    if (name[0] && client_chan_find(c, name) < 0) {
+        send_line(c, "ERR :not in channel");
+        return;
+    }
+
+    long want = cfg.history;
+    if (count && *count) {
+        char *end;
+        want = strtol(count, &end, 10);
+        if (*end != '\0' || want < 0) {
+            send_line(c, "ERR :bad history count");
+            return;
+        }
+    }
+    if (want > cfg.history) want = cfg.history;
+
+    const history_t *h = &global_history;
+    if (name[0]) {
+        int home = chan_home(name);
+        if (home != self->id) {
+            // the home worker answers with an XMSG_REPLY
+            xmsg_t *m = xmsg_new(XMSG_HISTORY_QUERY);
+            if (!m) {
+                send_line(c, "ERR :out of memory");
+                return;
+            }
+            m->worker = self->id;
+            m->client = client_handle(c);
+            m->count = (uint32_t)want;
+            snprintf(m->chan, sizeof(m->chan), "%s", name);
+            post(home, m);
+            c->awaiting |= AWAIT_REPLY;
+            return;
+        }
+        h = &channel_find(name)->history;
+    }
+
+    history_replay(c, h, (uint32_t)want);
+
+    frame_t *f = history_end_frame(name);
+    if (f) {
+        send_frame(c, f);
+        frame_unref(f);
+    }
+}
+
+// ----------------------- profile store -----------------------
+//
+// Profiles persist in a memory-mapped file shared by all workers, keyed
+// by nick. The file is a header, an open-addressing index of record
+// offsets, and variable-length records, all in place: startup maps it
+// and reads nothing. New records and a regrown index are appended at the
+// end; a record is rewritten in place when the new fields fit in it.
+// What gets left behind is counted, and once it is over a quarter of the
+// file and STORE_COMPACT_MIN, store_compact() copies the live records,
+// each trimmed to fit, to a new file that replaces the old one.
+//
+// Layout changes must bump STORE_VERSION.
+
+#define STORE_MAGIC   "CAVEPRF1"
+#define STORE_VERSION 1
+#define STORE_INDEX_INITIAL 1024          // index slots in a new file
+#define STORE_ALIGN   64                  // records are padded to this
+#define STORE_COMPACT_MIN (256 * 1024)    // dead bytes worth compacting away
+
+enum { PF_NICK, PF_DISPLAYNAME, PF_PRONOUNS, PF_BIO, PF_COUNT };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t index_cap;                   // slots, a power of two
+    uint32_t index_count;
+    uint32_t dead;                        // STORE_ALIGN units left behind
+    uint64_t index_off;
+    uint64_t used;                        // bytes of the file in use
+} store_header_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t reserved;
+    uint64_t off;                         // record offset, 0 if slot empty
+} store_slot_t;
+
+typedef struct {
+    uint32_t cap;                         // bytes reserved, header included
+    uint16_t len[PF_COUNT];               // field lengths, data in PF_ order
+    char data[];
+} store_rec_t;
+
+static struct {
+    const char *path;
+    int fd;
+    char *map;
+    size_t map_len;
+    pthread_rwlock_t lock;
+} store = { .fd = -1, .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+static const char *const field_name[PF_COUNT] = {
+    "NICK", "DISPLAYNAME", "PRONOUNS", "BIO",
+};
+
+// Longest value field f may be set to.
+static size_t field_max(int f) {
+    switch (f) {
+    case PF_DISPLAYNAME: return (size_t)cfg.max_display;
+    case PF_PRONOUNS:    return (size_t)cfg.max_pronouns;
+    case PF_BIO:         return (size_t)cfg.max_bio;
+    default:             return CAVE_NICK_MAX - 1;
+    }
+}
+
+static store_header_t *store_header(void) {
+    return (store_header_t *)store.map;
+}
+
+static store_slot_t *store_index(void) {
+    return (store_slot_t *)(store.map + store_header()->index_off);
+}
+
+static store_rec_t *store_rec(uint64_t off) {
+    return (store_rec_t *)(store.map + off);
+}
+
+// Bytes r needs, header included, before padding.
+static size_t store_rec_need(const store_rec_t *r) {
+    size_t need = sizeof(store_rec_t);
+    for (int f = 0; f < PF_COUNT; f++) need += r->len[f];
+    return need;
+}
+
+static size_t store_pad(size_t n) {
+    return (n + STORE_ALIGN - 1) & ~(size_t)(STORE_ALIGN - 1);
+}
+
+// Whether the record at off lies inside the used part of the file and
+// its fields fit in it. A damaged file can say anything; bad records are
+// treated as missing.
+static int store_rec_ok(uint64_t off) {
+    const store_header_t *hdr = store_header();
+    if (off < sizeof(store_header_t) || off % _Alignof(store_rec_t) != 0 ||
+        off > hdr->used || hdr->used - off < sizeof(store_rec_t)) {
+        return 0;
+    }
+    const store_rec_t *r = store_rec(off);
+    return r->cap <= hdr->used - off && store_rec_need(r) <= r->cap;
+}
+
+// Makes room for extra more bytes past header->used. Pointers into the
+// map are invalid afterwards.
+static int store_reserve(size_t extra) {
+    size_t need = store_header()->used + extra;
+    if (need <= store.map_len) return 0;
+
+    size_t len = store.map_len * 2;
+    while (len < need) len *= 2;
+    if (ftruncate(store.fd, (off_t)len) < 0) return -1;
+
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     store.fd, 0);
+    if (map == MAP_FAILED) return -1;
+    munmap(store.map, store.map_len);
+    store.map = map;
+    store.map_len = len;
+    return 0;
+}
+
+static store_slot_t *store_find(const char *nick, uint32_t h) {
+    store_header_t *hdr = store_header();
+    store_slot_t *index = store_index();
+    uint32_t mask = hdr->index_cap - 1;
+    size_t nick_len = strlen(nick);
+
+    uint32_t i = h & mask;
+    for (uint32_t n = 0; n < hdr->index_cap && index[i].off; n++, i = (i + 1) & mask) {
+        if (index[i].hash != h || !store_rec_ok(index[i].off)) continue;
+        store_rec_t *r = store_rec(index[i].off);
+        if (r->len[PF_NICK] == nick_len &&
+            memcmp(r->data, nick, nick_len) == 0) {
+            return &index[i];
+        }
+    }
+    return NULL;
+}
+
+static void store_place(store_slot_t *index, uint32_t cap,
+                        const store_slot_t *slot) {
+    uint32_t mask = cap - 1;
+    uint32_t i = slot->hash & mask;
+    while (index[i].off) i = (i + 1) & mask;
+    index[i] = *slot;
+}
+
+// Appends an index twice the size and moves the entries over. The old
+// one is left behind as dead space.
+static int store_grow_index(void) {
+    uint32_t cap = store_header()->index_cap * 2;
+    size_t bytes = (size_t)cap * sizeof(store_slot_t);
+    if (store_reserve(bytes) < 0) return -1;
+
+    store_header_t *hdr = store_header();
+    uint64_t off = hdr->used;
+    store_slot_t *index = (store_slot_t *)(store.map + off);
+    memset(index, 0, bytes);
+
+    store_slot_t *old = store_index();
+    for (uint32_t i = 0; i < hdr->index_cap; i++) {
+        if (old[i].off) store_place(index, cap, &old[i]);
+    }
+    hdr->dead += (uint32_t)(bytes / 2 / STORE_ALIGN);
+    hdr->used += bytes;
+    hdr->index_off = off;
+    hdr->index_cap = cap;
+    return 0;
+}
+
+static int store_open(const char *path) {
+    store.path = path;
+    store.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (store.fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(store.fd, &st) < 0) return -1;
+
+    int fresh = st.st_size == 0;
+    size_t index_bytes = STORE_INDEX_INITIAL * sizeof(store_slot_t);
+    size_t len = fresh ? sizeof(store_header_t) + index_bytes + 64 * 1024
+                       : (size_t)st.st_size;
+    if (fresh && ftruncate(store.fd, (off_t)len) < 0) return -1;
+    if (len < sizeof(store_header_t)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    store.map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     store.fd, 0);
+    if (store.map == MAP_FAILED) return -1;
+    store.map_len = len;
+
+    store_header_t *hdr = store_header();
+    if (fresh) {
+        memcpy(hdr->magic, STORE_MAGIC, sizeof(hdr->magic));
+        hdr->version = STORE_VERSION;
+        hdr->index_cap = STORE_INDEX_INITIAL;
+        hdr->index_count = 0;
+        hdr->dead = 0;
+        hdr->index_off = sizeof(store_header_t);
+        hdr->used = sizeof(store_header_t) + index_bytes;
+        return 0;
+    }
+
+    if (memcmp(hdr->magic, STORE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != STORE_VERSION ||
+        hdr->used > len || hdr->index_cap == 0 ||
+        (hdr->index_cap & (hdr->index_cap - 1)) != 0 ||
+        hdr->index_off + (uint64_t)hdr->index_cap * sizeof(store_slot_t) >
+            hdr->used) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+// fsyncs the directory path is in, so a rename there is durable.
+static int store_sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    char *dir = malloc(len + 2);
+    if (!dir) return -1;
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (len == 0) {
+        strcpy(dir, "/");
+    } else {
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// Copies the index and the live records, trimmed to fit, to a new file
+// and renames it over the old one. Called with the write lock held;
+// pointers into the map are invalid afterwards. On failure the old file
+// stays in use.
+static int store_compact(void) {
+    store_header_t *hdr = store_header();
+    store_slot_t *index = store_index();
+    size_t index_bytes = (size_t)hdr->index_cap * sizeof(store_slot_t);
+    size_t used = sizeof(store_header_t) + index_bytes;
+    for (uint32_t i = 0; i < hdr->index_cap; i++) {
+        if (index[i].off && store_rec_ok(index[i].off)) {
+            used += store_pad(store_rec_need(store_rec(index[i].off)));
+        }
+    }
+    size_t len = used + 64 * 1024;
+
+    size_t path_len = strlen(store.path);
+    char *tmp = malloc(path_len + sizeof(".tmp"));
+    if (!tmp) return -1;
+    memcpy(tmp, store.path, path_len);
+    memcpy(tmp + path_len, ".tmp", sizeof(".tmp"));
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char *map = MAP_FAILED;
+    if (fd < 0 || ftruncate(fd, (off_t)len) < 0 ||
+        (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0)) == MAP_FAILED) {
+        goto fail;
+    }
+
+    store_header_t *nh = (store_header_t *)map;
+    *nh = *hdr;
+    nh->dead = 0;
+    nh->index_count = 0;
+    nh->index_off = sizeof(store_header_t);
+    nh->used = used;
+
+    // damaged records are left out, so the index is rebuilt rather than
+    // copied (a hole would cut probe sequences short)
+    store_slot_t *ni = (store_slot_t *)(map + nh->index_off);
+    memset(ni, 0, index_bytes);
+    uint64_t off = nh->index_off + index_bytes;
+    for (uint32_t i = 0; i < hdr->index_cap; i++) {
+        if (!index[i].off || !store_rec_ok(index[i].off)) continue;
+
+        const store_rec_t *r = store_rec(index[i].off);
+        size_t need = store_rec_need(r);
+        memcpy(map + off, r, need);
+        ((store_rec_t *)(map + off))->cap = (uint32_t)store_pad(need);
+        store_slot_t slot = { index[i].hash, 0, off };
+        store_place(ni, hdr->index_cap, &slot);
+        nh->index_count++;
+        off += store_pad(need);
+    }
+
+    // the copy must be on disk before it replaces the original, and the
+    // rename must be before the old space can be reused
+    if (msync(map, len, MS_SYNC) < 0 || fsync(fd) < 0) goto fail;
+    if (rename(tmp, store.path) < 0) goto fail;
+    free(tmp);
+    if (store_sync_dir(store.path) < 0) perror("store: fsync directory");
+
+    munmap(store.map, store.map_len);
+    close(store.fd);
+    store.fd = fd;
+    store.map = map;
+    store.map_len = len;
+    return 0;
+
+fail:
+    if (map != MAP_FAILED) munmap(map, len);
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp);
+    }
+    free(tmp);
+    return -1;
+}
+
+static char *put_str(char *p, const char *s, size_t n) {
+    memcpy(p, s, n);
+    return p + n;
+}
+
+#define PUT_LIT(p, lit) put_str((p), (lit), sizeof(lit) - 1)
+
+// The whole PROFILE GET answer for nick, as one multi-line frame, or NULL
+// if the store has no profile for it. Built straight from the stored
+// lengths.
+static frame_t *store_profile_frame(const char *nick) {
+    pthread_rwlock_rdlock(&store.lock);
+    store_slot_t *slot = store_find(nick, nick_hash(nick));
+    if (!slot) {
+        pthread_rwlock_unlock(&store.lock);
+        return NULL;
+    }
+
+    // the stored nick is the one looked up
+    store_rec_t *r = store_rec(slot->off);
+    size_t nick_len = r->len[PF_NICK];
+    size_t len = sizeof("PROFILE END ") - 1 + nick_len + 2;
+    for (int f = PF_DISPLAYNAME; f < PF_COUNT; f++) {
+        if (r->len[f]) {
+            len += sizeof("PROFILE DATA  ") - 1 + nick_len +
+                   strlen(field_name[f]) + sizeof(" :\r\n") - 1 + r->len[f];
+        }
+    }
+
+    frame_t *fr = frame_alloc(len);
+    if (fr) {
+        char *p = fr->data;
+        const char *field = r->data + nick_len;
+        for (int f = PF_DISPLAYNAME; f < PF_COUNT; f++) {
+            if (r->len[f]) {
+                p = PUT_LIT(p, "PROFILE DATA ");
+                p = put_str(p, r->data, nick_len);
+                p = PUT_LIT(p, " ");
+                p = put_str(p, field_name[f], strlen(field_name[f]));
+                p = PUT_LIT(p, " :");
+                p = put_str(p, field, r->len[f]);
+                p = PUT_LIT(p, "\r\n");
+            }
+            field += r->len[f];
+        }
+        p = PUT_LIT(p, "PROFILE END ");
+        p = put_str(p, r->data, nick_len);
+        PUT_LIT(p, "\r\n");
+    }
+    pthread_rwlock_unlock(&store.lock);
+    return fr;
+}
+
+// Sets one field of nick's profile, creating the record if needed.
+static int store_set(const char *nick, int field, const char *value) {
+    const char *val[PF_COUNT] = { nick, "", "", "" };
+    size_t len[PF_COUNT] = { strlen(nick), 0, 0, 0 };
+    char *old = NULL;
+    uint32_t h = nick_hash(nick);
+    int rc = -1;
+
+    pthread_rwlock_wrlock(&store.lock);
+
+    // gather the fields we keep; copied, as growing the file remaps it
+    store_slot_t *slot = store_find(nick, h);
+    if (slot) {
+        store_rec_t *r = store_rec(slot->off);
+        old = malloc(store_rec_need(r));
+        if (!old) goto out;
+        const char *p = r->data + r->len[PF_NICK];
+        size_t used = 0;
+        for (int f = PF_DISPLAYNAME; f < PF_COUNT; f++) {
+            memcpy(old + used, p, r->len[f]);
+            val[f] = old + used;
+            len[f] = r->len[f];
+            used += r->len[f];
+            p += r->len[f];
+        }
+    }
+    val[field] = value;
+    len[field] = strlen(value);
+
+    size_t need = sizeof(store_rec_t);
+    for (int f = 0; f < PF_COUNT; f++) need += len[f];
+
+    uint64_t off;
+    if (slot && store_rec(slot->off)->cap >= need) {
+        off = slot->off;                      // fits where it is
+    } else {
+        size_t cap = store_pad(need);
+        if (!slot && (store_header()->index_count + 1) * 2 >
+                         store_header()->index_cap &&
+            store_grow_index() < 0) {
+            goto out;
+        }
+        if (store_reserve(cap) < 0) goto out;
+        off = store_header()->used;
+        store_header()->used += cap;
+        store_rec(off)->cap = (uint32_t)cap;
+    }
+
+    store_rec_t *r = store_rec(off);
+    char *p = r->data;
+    for (int f = 0; f < PF_COUNT; f++) {
+        memmove(p, val[f], len[f]);
+        r->len[f] = (uint16_t)len[f];
+        p += len[f];
+    }
+
+    // publish a new record only once it is complete
+    slot = store_find(nick, h);
+    if (slot) {
+        if (slot->off != off) {
+            store_header()->dead += store_rec(slot->off)->cap / STORE_ALIGN;
+            slot->off = off;
+        }
+    } else {
+        store_slot_t ns = { .hash = h, .off = off };
+        store_place(store_index(), store_header()->index_cap, &ns);
+        store_header()->index_count++;
+    }
+    rc = 0;
+
+    size_t dead = (size_t)store_header()->dead * STORE_ALIGN;
+    if (dead >= STORE_COMPACT_MIN && dead > store_header()->used / 4) {
+        store_compact();                      // not fatal if it fails
+    }
+
+out:
+    pthread_rwlock_unlock(&store.lock);
+    free(old);
+    return rc;
+}
+
+// ----------------------- PROFILE command handler -----------------------
+
+// PROFILE GET for a nick with nothing stored: an empty profile if it's
+// online, otherwise not found.
+static frame_t *profile_empty_frame(const char *nick, int online) {
+    return online ? frame_printf("PROFILE END %s", nick)
+                  : frame_printf("PROFILE ERR NOTFOUND %s", nick);
+}
+
+static void profile_set(client_t *c, const char *field, const char *value) {
+    int f = PF_DISPLAYNAME;
+    while (f < PF_COUNT && strcasecmp(field, field_name[f]) != 0) f++;
+    if (f == PF_COUNT) {
+        send_line(c, "PROFILE ERR FIELD");
+        return;
+    }
+
+    if (strlen(value) > field_max(f)) {
+        send_line(c, "PROFILE ERR VALUE_TOO_LONG");
+        return;
+    }
+    if (!c->nick[0]) {
+        send_line(c, "PROFILE ERR NO_NICK");
+        return;
+    }
+    if (store_set(c->nick, f, value) < 0) {
+        send_line(c, "PROFILE ERR STORE");
+        return;
+    }
+
+    char ok[32];
+    snprintf(ok, sizeof(ok), "PROFILE OK %s", field_name[f]);
+    send_line(c, ok);
+}
+
+static void profile_get(client_t *c, const char *target_nick) {
+    if (target_nick[0] == '\0') {
+        send_line(c, "PROFILE ERR SYNTAX");
+        return;
+    }
+
+    frame_t *f = store_profile_frame(target_nick);
+    int dest = nick_partition(target_nick);
+    if (!f && dest == self->id) {
+        f = profile_empty_frame(target_nick,
+                                nick_index_find(target_nick) != NULL);
+    }
+    if (f) {
+        send_frame(c, f);
+        frame_unref(f);
+        return;
+    }
+
+    // Nothing stored: whether the nick is online is up to its
+    // partition, which answers with an XMSG_REPLY.
+    xmsg_t *m = xmsg_new(XMSG_PROFILE_QUERY);
+    if (!m) {
+        send_line(c, "ERR :out of memory");
+        return;
+    }
+    m->worker = self->id;
+    m->client = client_handle(c);
+    snprintf(m->nick, sizeof(m->nick), "%s", target_nick);
+    post(dest, m);
+    c->awaiting |= AWAIT_REPLY;
+}
+
+// ----------------------- main command handler -----------------------
+
+static void nick_announce(client_t *c) {
+    char msg[128];
+    snprintf(msg, sizeof(msg),
+             "SYS :%s joined",
+             c->nick[0] ? c->nick : "anonymous");
+    broadcast_line(c, msg);
+    send_line(c, "SYS :nickname set");
+}
+
+// Finishes a NICK once the nick's partition has answered the claim.
+static void nick_claim_done(client_t *c, const char *nick, int result) {
+    if (result < 0) {
+        send_line(c, "ERR :out of memory");
+        return;
+    }
+    if (result == 0) {
+        send_line(c, "ERR :nickname in use");
+        return;
+    }
+
+    if (c->nick[0]) nick_release_for(c);
+    snprintf(c->nick, sizeof(c->nick), "%s", nick);
+    nick_announce(c);
+}
+
+// Nicks go into other lines as a single token, so no spaces or control
+// characters, and nothing that reads as a channel, sender or trailing
+// argument.
+static int nick_ok(const char *nick) {
+    if (nick[0] == '#' || nick[0] == '@' || nick[0] == ':') return 0;
+    for (const char *p = nick; *p; p++) {
+        if ((unsigned char)*p <= ' ' || *p == 0x7f) return 0;
+    }
+    return 1;
+}
+
+static void handle_nick(client_t *c, const char *name) {
+    char nick[CAVE_NICK_MAX];
+    snprintf(nick, sizeof(nick), "%s", name);
+
+    if (nick[0] == '\0' || strcmp(nick, c->nick) == 0) {
+        // dropping our nick, or re-sending the one we have
+        if (nick[0] == '\0' && c->nick[0]) {
+            nick_release_for(c);
+            c->nick[0] = '\0';
+        }
+        nick_announce(c);
+        return;
+    }
+
+    if (!nick_ok(nick)) {
+        send_line(c, "ERR :bad nickname");
+        return;
+    }
+
+    int p = nick_partition(nick);
+    if (p == self->id) {
+        nick_claim_done(c, nick,
+                        nick_index_claim(nick, self->id, client_handle(c)));
+        return;
+    }
+
+    // the partition answers with XMSG_NICK_RESULT; hold c's input
+    // until then so later commands see the new nick
+    xmsg_t *m = xmsg_new(XMSG_NICK_CLAIM);
+    if (!m) {
+        send_line(c, "ERR :out of memory");
+        return;
+    }
+    m->worker = self->id;
+    m->client = client_handle(c);
+    snprintf(m->nick, sizeof(m->nick), "%s", nick);
+    post(p, m);
+    c->awaiting |= AWAIT_REPLY;
+}
+
+// A message can go out in pieces: any number of MSGPART lines and then
+// the MSG that ends it, all with the same target. Recipients put the
+// pieces back together; the server forwards each one as it comes and
+// keeps only a running total, which cfg.max_message caps.
+
+// Sends one piece to chan, or to everyone when chan is NULL.
+static void msg_deliver(client_t *c, const char *chan, const char *text,
+                        int last) {
+    const char *from = c->nick[0] ? c->nick : "anon";
+    const char *verb = last ? "MSG" : "MSGPART";
+
+    if (chan) {
+        int i = client_chan_find(c, chan);
+        if (i < 0) return;
+
+        frame_t *msg = frame_printf("%s %s @%s :%s", verb, chan, from, text);
+        if (!msg) return;
+        channel_send(c->chans[i], msg, 1);
+        frame_unref(msg);
+        return;
+    }
+
+    frame_t *msg = frame_printf("%s @%s :%s", verb, from, text);
+    if (!msg) return;
+    broadcast_frame(c, msg, 1);
+    send_frame(c, msg);
+    frame_unref(msg);
+}
+
+// Ends a message that is partly out with an empty last piece, so the
+// recipients show what they have.
+static void msg_cut(client_t *c) {
+    if (c->part_bytes > 0) {
+        msg_deliver(c, c->part_chan[0] ? c->part_chan : NULL, "", 1);
+    }
+    c->part_bytes = 0;
+}
+
+static void msg_piece(client_t *c, const char *chan, const char *text,
+                      int last) {
+    const char *target = chan ? chan : "";
+
+    if ((c->part_bytes || c->part_skip) && strcmp(target, c->part_chan) != 0) {
+        // a new message before the last one was finished
+        msg_cut(c);
+        c->part_skip = 0;
+    }
+    if (c->part_skip) {
+        if (last) c->part_skip = 0;
+        return;
+    }
+
+    size_t len = strlen(text);
+    if (chan && client_chan_find(c, chan) < 0) {
+        send_line(c, "ERR :not in channel");
+        goto skip;
+    }
+    if (c->part_bytes + len > (size_t)cfg.max_message) {
+        send_line(c, "ERR :message too long");
+        msg_cut(c);
+        goto skip;
+    }
+
+    msg_deliver(c, chan, text, last);
+    c->part_bytes = last ? 0 : c->part_bytes + len;
+    if (!last) snprintf(c->part_chan, sizeof(c->part_chan), "%s", target);
+    return;
+
+skip:
+    if (!last) {
+        c->part_skip = 1;
+        snprintf(c->part_chan, sizeof(c->part_chan), "%s", target);
+    }
+}
+
+// MSG to everyone, or to a channel when chan isn't NULL.
+static void handle_msg(client_t *c, const char *chan, const char *text) {
+    msg_piece(c, chan, text, 1);
+}
+
+static void handle_msg_part(client_t *c, const char *chan, const char *text) {
+    msg_piece(c, chan, text, 0);
+}
+
+static void handle_proto(client_t *c, const char *proto) {
+    if (strcmp(proto, "BINARY") != 0) {
+        send_line(c, "ERR :unknown protocol");
+        return;
+    }
+
+    // the ack is the last text line; everything after it is binary
+    send_line(c, "PROTO BINARY");
+    c->binary = 1;
+}
+
+// ----- command table -----
+//
+// Every command is a descriptor: its verb, its binary opcode, the
+// arguments it takes and its handler. A schema is a list of argument
+// kinds, each optionally followed by '?' when it may be left out:
+//   w  a word
+//   c  a channel, a word starting with '#' (left out if the next word
+//      doesn't start with '#')
+//   t  text: what follows the first ':' in the rest of the line, or the
+//      rest as is if there is no ':'; may be empty
+//   v  a value: what follows the first ':', which must be there, with
+//      leading spaces trimmed
+//   r  the rest of the line as is, even if empty ("NICK " drops the
+//      nick); an absent binary field counts as empty
+// Absent optional arguments reach the handler as NULL. A command with
+// subcommands (PROFILE SET, PROFILE GET) takes its first word as the
+// subcommand's verb instead. A verb that needs arguments but has nothing
+// after it, not even a space, is an unknown command, as it always was.
+
+#define CMD_ARGS_MAX 4
+#define CMD_SLOTS    64                   // power of two, > number of verbs
+
+typedef struct cmd cmd_t;
+typedef void (*cmd_fn)(client_t *c, const char **arg);
+
+struct cmd {
+    const char *verb;
+    int op;                               // binary opcode, 0 if none
+    const char *schema;
+    cmd_fn run;
+    const cmd_t *sub;                     // subcommands, ended by a NULL verb
+    const char *bad;                      // reply when arguments don't fit
+};
+
+static void cmd_nick(client_t *c, const char **arg) {
+    handle_nick(c, arg[0]);
+}
+
+static void cmd_msg(client_t *c, const char **arg) {
+    handle_msg(c, arg[0], arg[1]);
+}
+
+static void cmd_msg_part(client_t *c, const char **arg) {
+    handle_msg_part(c, arg[0], arg[1]);
+}
+
+static void cmd_ping(client_t *c, const char **arg) {
+    (void)arg;
+    send_line(c, "PONG");
+}
+
+static void cmd_join(client_t *c, const char **arg) {
+    handle_join(c, arg[0]);
+}
+
+static void cmd_part(client_t *c, const char **arg) {
+    handle_part(c, arg[0]);
+}
+
+static void cmd_history(client_t *c, const char **arg) {
+    handle_history(c, arg[0] ? arg[0] : "", arg[1]);
+}
+
+static void cmd_profile_set(client_t *c, const char **arg) {
+    profile_set(c, arg[0], arg[1]);
+}
+
+static void cmd_profile_get(client_t *c, const char **arg) {
+    profile_get(c, arg[0]);
+}
+
+// The answer to our keepalive PING; reading it was all that mattered.
+static void cmd_pong(client_t *c, const char **arg) {
+    (void)c;
+    (void)arg;
+}
+
+static void cmd_proto(client_t *c, const char **arg) {
+    handle_proto(c, arg[0]);
+}
+
+static void handle_stats(client_t *c);
+
+static void cmd_stats(client_t *c, const char **arg) {
+    (void)arg;
+    handle_stats(c);
+}
+
+static const cmd_t profile_cmds[] = {
+    { "SET", 0, "wv", cmd_profile_set, NULL, "PROFILE ERR SYNTAX" },
+    { "GET", 0, "w",  cmd_profile_get, NULL, "PROFILE ERR SYNTAX" },
+    { NULL },
+};
+
+static const cmd_t cmds[] = {
+    { "NICK",    OP_NICK,    "r",    cmd_nick,    NULL, NULL },
+    { "MSG",     OP_MSG,     "c?t",  cmd_msg,     NULL, NULL },
+    { "MSGPART", OP_MSGPART, "c?t",  cmd_msg_part, NULL, NULL },
+    { "PING",    OP_PING,    "",     cmd_ping,    NULL, NULL },
+    { "JOIN",    OP_JOIN,    "r",    cmd_join,    NULL, NULL },
+    { "PART",    OP_PART,    "r",    cmd_part,    NULL, NULL },
+    { "HISTORY", OP_HISTORY, "c?w?", cmd_history, NULL, NULL },
+    { "PROFILE", OP_PROFILE, "",     NULL,        profile_cmds,
+      "PROFILE ERR SYNTAX" },
+    { "PROTO",   OP_PROTO,   "w",    cmd_proto,   NULL, NULL },
+    { "STATS",   OP_STATS,   "",     cmd_stats,   NULL, NULL },
+    { "PONG",    OP_PONG,    "",     cmd_pong,    NULL, NULL },
+};
+
+#define CMD_COUNT (sizeof(cmds) / sizeof(cmds[0]))
+
+_Static_assert(CMD_COUNT <= STAT_VERBS, "raise STAT_VERBS");
+
+// Runs a command, counting it and timing it under its top-level verb.
+static void cmd_run(client_t *c, const cmd_t *top, const cmd_t *cmd,
+                    const char **arg) {
+    size_t i = (size_t)(top - cmds);
+    uint64_t start = now_ns();
+    cmd->run(c, arg);
+    uint64_t end = now_ns();
+    stat_add(&stats->commands[i], 1);
+    stat_observe(&stats->command_ns[i], end - start);
+    TRACE_SPAN(top->verb, start, end);
+}
+
+// Verb lookup is a perfect hash: cmd_index_init() searches for a seed
+// that puts every verb in its own slot, so a lookup is one hash and one
+// compare however many verbs there are.
+static const cmd_t *cmd_slot[CMD_SLOTS];
+static const cmd_t *cmd_by_op[OP_COUNT];
+static uint32_t cmd_seed;
+
+static uint32_t verb_hash(const char *v, size_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)v[i];
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 15)) & (CMD_SLOTS - 1);
+}
+
+static int cmd_index_init(void) {
+    for (uint32_t seed = 0; seed < 100000; seed++) {
+        size_t i;
+        memset(cmd_slot, 0, sizeof(cmd_slot));
+        for (i = 0; i < CMD_COUNT; i++) {
+            uint32_t h = verb_hash(cmds[i].verb, strlen(cmds[i].verb), seed);
+            if (cmd_slot[h]) break;
+            cmd_slot[h] = &cmds[i];
+        }
+        if (i == CMD_COUNT) {
+            cmd_seed = seed;
+            for (i = 0; i < CMD_COUNT; i++) {
+                if (cmds[i].op) cmd_by_op[cmds[i].op] = &cmds[i];
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const cmd_t *cmd_lookup(const char *verb, size_t len) {
+    const cmd_t *cmd = cmd_slot[verb_hash(verb, len, cmd_seed)];
+    if (cmd && strlen(cmd->verb) == len && memcmp(cmd->verb, verb, len) == 0) {
+        return cmd;
+    }
+    return NULL;
+}
+
+static const cmd_t *cmd_sub_lookup(const cmd_t *cmd, const char *verb) {
+    for (const cmd_t *sub = cmd->sub; sub->verb; sub++) {
+        if (strcmp(sub->verb, verb) == 0) return sub;
+    }
+    return NULL;
+}
+
+static void cmd_bad(client_t *c, const cmd_t *cmd) {
+    send_line(c, cmd->bad ? cmd->bad : "ERR :bad arguments");
+}
+
+static void cmd_unknown(client_t *c) {
+    stat_add(&stats->commands[STAT_VERBS], 1);
+    send_line(c, "ERR :unknown command");
+}
+
+// Whether cmd can't do without arguments.
+static int cmd_needs_args(const cmd_t *cmd) {
+    if (cmd->sub) return 1;
+    for (const char *k = cmd->schema; *k; k++) {
+        if (k[1] == '?') k++;
+        else return 1;
+    }
+    return 0;
+}
+
+// Cuts the word at *p out of a writable line, NUL-terminating it.
+static char *next_word(char **p) {
+    char *w = *p;
+    char *end = w + strcspn(w, " ");
+    *p = end;
+    if (*end) {
+        *end = '\0';
+        *p = end + 1;
+    }
+    return w;
+}
+
+// Text: the words after the verb, matched against the schema.
+static void handle_command(client_t *c, const char *text, size_t len) {
+    if (memchr(text, '\0', len)) {
+        send_line(c, "ERR :bad line");
+        return;
+    }
+
+    char line[BUF_SIZE];
+    memcpy(line, text, len);
+    line[len] = '\0';
+
+    char *p = line;
+    int bare = line[strcspn(line, " ")] == '\0';   // nothing after the verb
+    char *verb = next_word(&p);
+    const cmd_t *cmd = cmd_lookup(verb, strlen(verb));
+    if (!cmd || (bare && cmd_needs_args(cmd))) {
+        cmd_unknown(c);
+        return;
+    }
+    const cmd_t *top = cmd;
+    if (cmd->sub) {
+        while (*p == ' ') p++;
+        const cmd_t *sub = cmd_sub_lookup(cmd, next_word(&p));
+        if (!sub) {
+            cmd_bad(c, cmd);
+            return;
+        }
+        cmd = sub;
+    }
+
+    const char *arg[CMD_ARGS_MAX] = { NULL };
+    int n = 0;
+    for (const char *k = cmd->schema; *k; k++, n++) {
+        int optional = (k[1] == '?');
+        if (*k == 'r' || *k == 't') {
+            char *colon = *k == 't' ? strchr(p, ':') : NULL;
+            arg[n] = colon ? colon + 1 : p;
+            p += strlen(p);
+            continue;
+        }
+        // spaces are only used up along with an argument, so a 't' after
+        // an absent 'c' gets them
+        char *q = p;
+        while (*q == ' ') q++;
+
+        char *colon = strchr(q, ':');
+        if (*q == '\0' || (*k == 'c' && *q != '#') || (*k == 'v' && !colon)) {
+            if (!optional) goto bad;
+        } else if (*k == 'v') {
+            arg[n] = colon + 1;
+            while (*arg[n] == ' ') arg[n]++;
+            p = q + strlen(q);
+        } else {
+            p = q;
+            arg[n] = next_word(&p);
+        }
+        if (optional) k++;
+    }
+    while (*p == ' ') p++;
+    if (*p) goto bad;
+
+    cmd_run(c, top, cmd, arg);
+    return;
+
+bad:
+    cmd_bad(c, cmd);
+}
+
+// Binary: one frame's opcode and fields (see encode_line), matched
+// against the same schema one field per argument. Fields are copied out
+// NUL-terminated and may not contain CR, LF or NUL, as they end up in
+// text lines for text clients.
+static void handle_binary(client_t *c, const unsigned char *data, size_t len) {
+    char scratch[BUF_SIZE];
+    const char *field[BIN_FIELDS_MAX];
+    size_t nf = 0, used = 0;
+
+    if (len < 1) goto bad_frame;
+    for (size_t pos = 1; pos < len; ) {
+        if (nf == BIN_FIELDS_MAX || len - pos < 2) goto bad_frame;
+        size_t flen = ((size_t)data[pos] << 8) | data[pos + 1];
+        pos += 2;
+        if (flen > len - pos) goto bad_frame;
+        for (size_t i = 0; i < flen; i++) {
+            unsigned char ch = data[pos + i];
+            if (ch == '\0' || ch == '\r' || ch == '\n') goto bad_frame;
+        }
+
+        memcpy(scratch + used, data + pos, flen);
+        scratch[used + flen] = '\0';
+        field[nf++] = scratch + used;
+        used += flen + 1;
+        pos += flen;
+    }
+
+    const cmd_t *cmd = data[0] < OP_COUNT ? cmd_by_op[data[0]] : NULL;
+    if (!cmd) {
+        cmd_unknown(c);
+        return;
+    }
+    const cmd_t *top = cmd;
+
+    size_t i = 0;
+    if (cmd->sub) {
+        const cmd_t *sub = nf ? cmd_sub_lookup(cmd, field[i++]) : NULL;
+        if (!sub) {
+            cmd_bad(c, cmd);
+            return;
+        }
+        cmd = sub;
+    }
+
+    const char *arg[CMD_ARGS_MAX] = { NULL };
+    int n = 0;
+    for (const char *k = cmd->schema; *k; k++, n++) {
+        int optional = (k[1] == '?');
+        if (*k == 'r' && i == nf) {
+            arg[n] = "";
+        } else if (i == nf || (*k == 'c' && field[i][0] != '#')) {
+            if (!optional) goto bad;
+        } else {
+            arg[n] = field[i++];
+        }
+        if (optional) k++;
+    }
+    if (i != nf) goto bad;
+
+    cmd_run(c, top, cmd, arg);
+    return;
+
+bad:
+    cmd_bad(c, cmd);
+    return;
+
+bad_frame:
+    send_line(c, "ERR :bad frame");
+}
+
+// ----------------------- metrics reporting -----------------------
+//
+// The same samples two ways: Prometheus text for /metrics, and for STATS
+// one "STATS name value" line each, histograms as just _count and _sum.
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;                              // out of memory; data is partial
+} sbuf_t;
+
+static void sbuf_printf(sbuf_t *b, const char *fmt, ...) {
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = b->failed ? -1 : vsnprintf(b->data + b->len,
+                                           b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < b->cap - b->len) {
+            b->len += (size_t)n;
+            return;
+        }
+
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap - b->len <= (size_t)n) cap *= 2;
+        char *data = realloc(b->data, cap);
+        if (!data) {
+            b->failed = 1;
+            return;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+}
+
+static void sbuf_add(sbuf_t *b, const void *data, size_t len) {
+    if (b->failed || len == 0) return;
+    if (b->cap - b->len < len) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap - b->len < len) cap *= 2;
+        char *p = realloc(b->data, cap);
+        if (!p) {
+            b->failed = 1;
+            return;
+        }
+        b->data = p;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static uint64_t stat_get(const stat_t *s) {
+    return atomic_load_explicit(s, memory_order_relaxed);
+}
+
+// Every worker's stats added up. stats_t is nothing but stat_t fields,
+// so it can be walked as an array of them.
+static void stats_total(stats_t *total) {
+    _Static_assert(sizeof(stats_t) % sizeof(stat_t) == 0, "stats_t layout");
+    stat_t *dst = (stat_t *)total;
+    size_t n = sizeof(stats_t) / sizeof(stat_t);
+
+    memset(total, 0, sizeof(*total));
+    for (int w = 0; w < worker_count; w++) {
+        const stat_t *src = (const stat_t *)&workers[w].stats;
+        for (size_t i = 0; i < n; i++) stat_add(&dst[i], stat_get(&src[i]));
+    }
+}
+
+static void metric_head(sbuf_t *b, int prom, const char *name,
+                        const char *type, const char *help) {
+    if (prom) sbuf_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metric_value(sbuf_t *b, int prom, const char *name,
+                         const char *labels, uint64_t v) {
+    sbuf_printf(b, "%s%s%s %llu%s", prom ? "" : "STATS ", name, labels,
+                (unsigned long long)v, prom ? "\n" : "\r\n");
+}
+
+// A histogram; scale converts values to the unit the name promises
+// (e.g. ns to seconds). verb, if not NULL, becomes a label.
+static void metric_hist(sbuf_t *b, int prom, const char *name, const char *verb,
+                        const stat_hist_t *h, double scale) {
+    char labels[64] = "", lead[64] = "", key[96];
+    if (verb) {
+        snprintf(labels, sizeof(labels), "{verb=\"%s\"}", verb);
+        snprintf(lead, sizeof(lead), "verb=\"%s\",", verb);
+    }
+
+    if (prom) {
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < STAT_BUCKETS - 1; i++) {
+            seen += stat_get(&h->bucket[i]);
+            sbuf_printf(b, "%s_bucket{%sle=\"%g\"} %llu\n", name, lead,
+                        (double)((uint64_t)1 << i) * scale,
+                        (unsigned long long)seen);
+        }
+        sbuf_printf(b, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, lead,
+                    (unsigned long long)stat_get(&h->count));
+    }
+    sbuf_printf(b, "%s%s_sum%s %g%s", prom ? "" : "STATS ", name, labels,
+                (double)stat_get(&h->sum) * scale, prom ? "\n" : "\r\n");
+    snprintf(key, sizeof(key), "%s_count", name);
+    metric_value(b, prom, key, labels, stat_get(&h->count));
+}
+
+static void metrics_render(sbuf_t *b, int prom) {
+    stats_t t;
+    stats_total(&t);
+
+    metric_head(b, prom, "cave_connections_accepted_total", "counter",
+                "Connections accepted.");
+    metric_value(b, prom, "cave_connections_accepted_total", "", stat_get(&t.accepted));
+    metric_head(b, prom, "cave_connections_rejected_total", "counter",
+                "Connections turned away because the server was full.");
+    metric_value(b, prom, "cave_connections_rejected_total", "", stat_get(&t.rejected));
+    metric_head(b, prom, "cave_clients_throttled_total", "counter",
+                "Times a client's input was paused for exceeding its rate.");
+    metric_value(b, prom, "cave_clients_throttled_total", "", stat_get(&t.throttled));
+    metric_head(b, prom, "cave_connections_timed_out_total", "counter",
+                "Connections closed for not registering or not answering PING.");
+    metric_value(b, prom, "cave_connections_timed_out_total", "", stat_get(&t.timed_out));
+    metric_head(b, prom, "cave_clients", "gauge", "Clients connected.");
+    metric_value(b, prom, "cave_clients", "",
+                 stat_get(&t.accepted) - stat_get(&t.closed));
+    metric_head(b, prom, "cave_received_bytes_total", "counter",
+                "Bytes read from clients.");
+    metric_value(b, prom, "cave_received_bytes_total", "", stat_get(&t.bytes_in));
+    metric_head(b, prom, "cave_sent_bytes_total", "counter",
+                "Bytes written to clients.");
+    metric_value(b, prom, "cave_sent_bytes_total", "", stat_get(&t.bytes_out));
+    metric_head(b, prom, "cave_input_buffer_bytes", "gauge",
+                "Input buffer memory held by clients with a partial line.");
+    metric_value(b, prom, "cave_input_buffer_bytes", "", stat_get(&t.inbuf_bytes));
+
+    metric_head(b, prom, "cave_commands_total", "counter", "Commands handled, by verb.");
+    for (size_t i = 0; i <= CMD_COUNT; i++) {
+        char labels[64];
+        size_t k = i < CMD_COUNT ? i : STAT_VERBS;
+        snprintf(labels, sizeof(labels), "{verb=\"%s\"}",
+                 i < CMD_COUNT ? cmds[i].verb : "unknown");
+        metric_value(b, prom, "cave_commands_total", labels, stat_get(&t.commands[k]));
+    }
+
+    metric_head(b, prom, "cave_command_duration_seconds", "histogram",
+                "Time spent handling a command, by verb.");
+    for (size_t i = 0; i < CMD_COUNT; i++) {
+        metric_hist(b, prom, "cave_command_duration_seconds", cmds[i].verb,
+                    &t.command_ns[i], 1e-9);
+    }
+    metric_head(b, prom, "cave_fanout_recipients", "histogram",
+                "Recipients on one worker per broadcast or channel message.");
+    metric_hist(b, prom, "cave_fanout_recipients", NULL, &t.fanout, 1);
+    metric_head(b, prom, "cave_outq_bytes", "histogram",
+                "Bytes queued for a client when it is flushed.");
+    metric_hist(b, prom, "cave_outq_bytes", NULL, &t.outq, 1);
+}
+
+static void handle_stats(client_t *c) {
+    if (!c->admin) {
+        send_line(c, "ERR :not allowed");
+        return;
+    }
+
+    sbuf_t b = { NULL, 0, 0, 0 };
+    metrics_render(&b, 0);
+    sbuf_printf(&b, "STATS END\r\n");
+
+    frame_t *f = b.failed ? NULL : frame_new(b.data, b.len);
+    free(b.data);
+    if (!f) {
+        send_line(c, "ERR :out of memory");
+        return;
+    }
+    send_frame(c, f);
+    frame_unref(f);
+}
+
+// Serves GET /metrics on its own thread, one connection at a time; it
+// only ever reads the workers' counters.
+static void *metrics_main(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            // out of descriptors or memory: give it a moment to clear
+            if (errno != EINTR && errno != ECONNABORTED) {
+                struct timespec ts = { 0, 100000000 };
+                nanosleep(&ts, NULL);
+            }
+            continue;
+        }
+
+        struct timeval tv = { 2, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        // the request line is all we look at
+        char req[1024];
+        ssize_t n = recv(fd, req, sizeof(req) - 1, 0);
+        req[n > 0 ? n : 0] = '\0';
+
+        sbuf_t b = { NULL, 0, 0, 0 };
+        const char *status = "404 Not Found";
+        if (strncmp(req, "GET /metrics", 12) == 0 &&
+            (req[12] == ' ' || req[12] == '?')) {
+            metrics_render(&b, 1);
+            status = b.failed ? "500 Internal Server Error" : "200 OK";
+        }
+        if (b.failed) b.len = 0;
+
+        char head[256];
+        int hlen = snprintf(head, sizeof(head),
+                            "HTTP/1.0 %s\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n", status, b.len);
+        struct iovec iov[2] = {
+            { head, (size_t)hlen },
+            { b.data, b.len },
+        };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = b.len ? 2 : 1;
+        sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        free(b.data);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int metrics_listen(void) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)cfg.metrics_port);
+    if (inet_pton(AF_INET, cfg.metrics_addr, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad --metrics-addr: %s\n", cfg.metrics_addr);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 8) < 0) {
+        perror("metrics listener");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// The listener, once open; a hot upgrade sets it to the one it inherited
+// before metrics_start() runs.
+static int metrics_listen_fd = -1;
+
+static int metrics_start(void) {
+    if (metrics_listen_fd < 0) metrics_listen_fd = metrics_listen();
+    if (metrics_listen_fd < 0) return -1;
+
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, metrics_main,
+                             (void *)(intptr_t)metrics_listen_fd);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// ----------------------- timers -----------------------
+//
+// A hierarchical timer wheel per worker: WHEEL_LEVELS rings of
+// WHEEL_SLOTS lists, level L ticking once every WHEEL_SLOTS^L ms. A timer
+// is linked into the slot of the highest level where its due tick and the
+// current tick differ, and is moved down a level each time the wheel
+// reaches that slot, so arming and cancelling are O(1) list operations and
+// a pass only touches timers that are (nearly) due.
+
+#define WHEEL_TICK_NS 1000000u               // 1 ms
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1u << WHEEL_BITS)
+#define WHEEL_LEVELS  5                      // 2^30 ms, about 12 days
+#define WHEEL_SPAN    ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS - 1))   // furthest ahead, ticks
+#define WHEEL_MAX_S   (1L << 19)             // longest timeout we accept, s
+
+static _Thread_local struct {
+    wheel_timer_t slot[WHEEL_LEVELS][WHEEL_SLOTS];   // list heads
+    uint64_t now;                            // last tick run
+    size_t count;                            // timers armed
+} wheel;
+
+static _Thread_local uint64_t loop_tick;     // loop passes so far
+static _Thread_local uint64_t loop_now;      // when this pass began, ns
+static _Thread_local int      upgrading;     // clients paused for a hot upgrade
+
+static void wheel_init(void) {
+    for (unsigned l = 0; l < WHEEL_LEVELS; l++) {
+        for (unsigned i = 0; i < WHEEL_SLOTS; i++) {
+            wheel.slot[l][i].next = wheel.slot[l][i].prev = &wheel.slot[l][i];
+        }
+    }
+    wheel.now = now_ns() / WHEEL_TICK_NS;
+    wheel.count = 0;
+}
+
+// Due now goes in the bottom slot about to be run (see wheel_run()).
+static void wheel_link(wheel_timer_t *t) {
+    uint64_t diff = t->due ^ wheel.now;
+    unsigned level = diff ? (63u - (unsigned)__builtin_clzll(diff)) / WHEEL_BITS : 0;
+    if (level >= WHEEL_LEVELS) level = WHEEL_LEVELS - 1;   // across a top slot boundary
+    wheel_timer_t *head =
+        &wheel.slot[level][(t->due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void wheel_unlink(wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+}
+
+static void wheel_cancel(wheel_timer_t *t) {
+    if (!t->next) return;
+    wheel_unlink(t);
+    wheel.count--;
+}
+
+// (Re)arms t to call fire at time when, in ns.
+static void wheel_arm(wheel_timer_t *t, uint64_t when,
+                      void (*fire)(wheel_timer_t *t)) {
+    wheel_cancel(t);
+    t->fire = fire;
+    t->due = (when + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    if (t->due <= wheel.now) t->due = wheel.now + 1;   // this tick has run
+    if (t->due - wheel.now > WHEEL_SPAN) t->due = wheel.now + WHEEL_SPAN;
+    wheel_link(t);
+    wheel.count++;
+}
+
+// Runs every timer due by now (ns). A timer may re-arm itself or others.
+static void wheel_run(uint64_t now) {
+    uint64_t to = now / WHEEL_TICK_NS;
+    if (wheel.count == 0) {
+        if (to > wheel.now) wheel.now = to;
+        return;
+    }
+
+    while (wheel.now < to) {
+        wheel.now++;
+
+        // moving into a new slot of level L: spread it over the levels below
+        for (unsigned l = WHEEL_LEVELS - 1; l > 0; l--) {
+            if (wheel.now & (((uint64_t)1 << (WHEEL_BITS * l)) - 1)) continue;
+            wheel_timer_t *head =
+                &wheel.slot[l][(wheel.now >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1)];
+            while (head->next != head) {
+                wheel_timer_t *t = head->next;
+                wheel_unlink(t);
+                wheel_link(t);
+            }
+        }
+
+        wheel_timer_t *head = &wheel.slot[0][wheel.now & (WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            wheel_timer_t *t = head->next;
+            wheel_unlink(t);
+            wheel.count--;
+            t->fire(t);
+        }
+        if (wheel.count == 0) wheel.now = to;
+    }
+}
+
+static int64_t wheel_ns_until(uint64_t tick) {
+    uint64_t due = tick * WHEEL_TICK_NS, now = now_ns();
+    return due > now ? (int64_t)(due - now) : 0;
+}
+
+// How long until the wheel needs running again, in ns, or -1 if it has
+// nothing armed: until the first timer due, if it is in the bottom level,
+// or else until the wheel reaches the first slot it has to cascade.
+static int64_t wheel_idle_ns(void) {
+    if (wheel.count == 0) return -1;
+
+    for (unsigned l = 0; l < WHEEL_LEVELS; l++) {
+        unsigned shift = WHEEL_BITS * l;
+        uint64_t base = wheel.now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS);
+        for (uint64_t d = ((wheel.now >> shift) & (WHEEL_SLOTS - 1)) + 1;
+             d < WHEEL_SLOTS; d++) {
+            wheel_timer_t *head = &wheel.slot[l][d];
+            if (head->next == head) continue;
+
+            return wheel_ns_until(base | d << shift);
+        }
+    }
+
+    // only timers past the end of the top level: its next slot, then
+    unsigned top = WHEEL_BITS * (WHEEL_LEVELS - 1);
+    return wheel_ns_until(((wheel.now >> top) + 1) << top);
+}
+
+// ----------------------- input pacing -----------------------
+//
+// Every command a client sends is paid for from two token buckets, one
+// counting commands and one counting input bytes, kept as the time each
+// would be full again (GCRA): a command may run while the bucket is at
+// least one token short of empty, then pushes that time on by its cost.
+// A client over either rate stops being read until the buckets refill,
+// which pushes back on its socket, or is disconnected under
+// --flood-policy disconnect. Separately, no client runs more than
+// --tick-lines commands in one loop pass: the rest wait for the next
+// pass, so one pipelined recv can't hold up every other socket.
+
+// Clients waiting for the next pass, by handle as they may go away
+// meanwhile. Those waiting on their rate have a turn_timer instead.
+static _Thread_local client_handle_t *turn_list = NULL;
+static _Thread_local size_t turn_count = 0;
+static _Thread_local size_t turn_cap = 0;
+
+static void handle_client_data(client_t *c);
+
+static void client_turn_fire(wheel_timer_t *t) {
+    client_t *c = CONTAINER_OF(t, client_t, turn_timer);
+    if (c->closing || !(c->awaiting & AWAIT_TURN)) return;
+    c->awaiting &= ~AWAIT_TURN;
+    if (!c->awaiting) handle_client_data(c);
+}
+
+// Pauses c until when (ns), or until the next pass if when is 0.
+static void client_defer(client_t *c, uint64_t when) {
+    if (when) {
+        c->awaiting |= AWAIT_TURN;
+        wheel_arm(&c->turn_timer, when, client_turn_fire);
+        return;
+    }
+    if (turn_count == turn_cap) {
+        size_t cap = turn_cap ? turn_cap * 2 : 64;
+        client_handle_t *list = realloc(turn_list, cap * sizeof(*list));
+        if (!list) {
+            client_kill(c);
+            return;
+        }
+        turn_list = list;
+        turn_cap = cap;
+    }
+    c->awaiting |= AWAIT_TURN;
+    turn_list[turn_count++] = client_handle(c);
+}
+
+// Whether c may run another command now. If not, c is paused (or
+// disconnected) and the caller leaves its input where it is.
+static int client_admit(client_t *c) {
+    if (c->turn_tick != loop_tick) {
+        c->turn_tick = loop_tick;
+        c->turn_lines = 0;
+    }
+    if (cfg.tick_lines && c->turn_lines >= (uint64_t)cfg.tick_lines) {
+        client_defer(c, 0);                  // next pass
+        return 0;
+    }
+
+    uint64_t wait = 0;
+    if (cfg.cmd_ns) {
+        uint64_t limit = loop_now + cfg.cmd_ns * (uint64_t)(cfg.cmd_burst - 1);
+        if (c->cmd_tat > limit) wait = c->cmd_tat - limit;
+    }
+    if (cfg.byte_ns) {
+        uint64_t limit = loop_now + cfg.byte_ns * (uint64_t)cfg.byte_burst;
+        if (c->byte_tat > limit && c->byte_tat - limit > wait) {
+            wait = c->byte_tat - limit;
+        }
+    }
+    if (wait == 0) return 1;
+
+    stat_add(&stats->throttled, 1);
+    if (cfg.flood_mode == FLOOD_DISCONNECT) {
+        client_kill_with(c, "ERR :flooding");
+    } else {
+        client_defer(c, loop_now + wait);
+    }
+    return 0;
+}
+
+// Pays for a command (cmds 1) or a further piece of one (cmds 0) of
+// len input bytes.
+static void client_charge(client_t *c, int cmds, size_t len) {
+    c->turn_lines++;
+    if (cfg.cmd_ns && cmds) {
+        if (c->cmd_tat < loop_now) c->cmd_tat = loop_now;
+        c->cmd_tat += cfg.cmd_ns;
+    }
+    if (cfg.byte_ns) {
+        if (c->byte_tat < loop_now) c->byte_tat = loop_now;
+        c->byte_tat += cfg.byte_ns * (uint64_t)len;
+    }
+}
+
+// ----------------------- connection liveness -----------------------
+//
+// One timer per client. A new client has --nick-timeout to send NICK, and
+// any client silent for --idle-timeout gets a PING and has --pong-timeout
+// to send anything at all back. Reads only note the time in last_input;
+// the timer looks at it when it fires and arms itself again for whatever
+// is due next, so busy clients cost nothing.
+
+#define SECONDS(n) ((uint64_t)(n) * 1000000000u)
+
+static void client_timeout(client_t *c, const char *why) {
+    stat_add(&stats->timed_out, 1);
+    client_kill_with(c, why);
+}
+
+static void client_live_fire(wheel_timer_t *t) {
+    client_t *c = CONTAINER_OF(t, client_t, live_timer);
+    if (c->closing) return;
+    uint64_t now = loop_now, next = UINT64_MAX;
+
+    if (c->nick_due) {
+        if (c->nick[0]) {
+            c->nick_due = 0;
+        } else if (now >= c->nick_due) {
+            client_timeout(c, "ERR :nickname timeout");
+            return;
+        }
+    }
+
+    if (c->ping_sent) {
+        if (c->last_input >= c->ping_sent) {
+            c->ping_sent = 0;                // answered
+        } else if (now >= c->ping_sent + SECONDS(cfg.pong_timeout)) {
+            client_timeout(c, "ERR :ping timeout");
+            return;
+        } else {
+            next = c->ping_sent + SECONDS(cfg.pong_timeout);
+        }
+    }
+    if (!c->ping_sent && cfg.idle_timeout) {
+        next = c->last_input + SECONDS(cfg.idle_timeout);
+        if (now >= next) {
+            send_line(c, "PING");
+            c->ping_sent = now;
+            next = now + SECONDS(cfg.pong_timeout);
+        }
+    }
+
+    if (c->nick_due && c->nick_due < next) next = c->nick_due;
+    if (next != UINT64_MAX) wheel_arm(t, next, client_live_fire);
+}
+
+// Starts the clock on a new client.
+static void client_live_start(client_t *c) {
+    c->last_input = loop_now;
+    c->ping_sent = 0;
+    c->nick_due = cfg.nick_timeout ? loop_now + SECONDS(cfg.nick_timeout) : 0;
+
+    uint64_t next = cfg.idle_timeout ? loop_now + SECONDS(cfg.idle_timeout) : UINT64_MAX;
+    if (c->nick_due && c->nick_due < next) next = c->nick_due;
+    if (next != UINT64_MAX) wheel_arm(&c->live_timer, next, client_live_fire);
+}
+
+// Starts a loop pass: runs due timers, then the clients whose turn it is.
+static void loop_begin_tick(void) {
+    loop_tick++;
+    loop_now = now_ns();
+    wheel_run(loop_now);
+
+    // resuming can pause clients again, appending past n
+    size_t n = turn_count;
+    for (size_t i = 0; i < n; i++) {
+        client_t *c = client_get(turn_list[i]);
+        if (!c || c->closing || !(c->awaiting & AWAIT_TURN)) continue;
+        c->awaiting &= ~AWAIT_TURN;
+        if (!c->awaiting) handle_client_data(c);
+    }
+    if (n == 0) return;                 // turn_list may still be NULL
+    memmove(turn_list, turn_list + n, (turn_count - n) * sizeof(*turn_list));
+    turn_count -= n;
+}
+
+// How long the loop may sleep, in ns, or -1 for as long as it likes.
+// While a hot upgrade is under way, wake at least every UPGRADE_POLL_NS.
+static int64_t loop_idle_ns(void) {
+    if (turn_count) return 0;
+    int64_t ns = wheel_idle_ns();
+    if (upgrading && (ns < 0 || ns > UPGRADE_POLL_NS)) ns = UPGRADE_POLL_NS;
+    return ns;
+}
+
+// ----------------------- socket read loop per client -----------------------
+
+static void client_disconnect(client_t *c) {
+    stat_add(&stats->closed, 1);
+    wheel_cancel(&c->turn_timer);
+    wheel_cancel(&c->live_timer);
+    msg_cut(c);                      // don't leave recipients mid-message
+    if (c->nick[0]) nick_release_for(c);
+    while (c->chan_count) channel_remove(c, c->chan_count - 1);
+    loop_del(c->fd);
+    close(c->fd);
+    out_clear(c);
+    client_input_drop(c);
+#ifdef CAVE_USE_URING
+    free(c->send_iov);
+    free(c->held);
+#endif
+    client_free(c);
+}
+
+// The input buffer is full and holds no newline. A MSG or MSGPART is sent
+// on in MSGPART pieces as the rest of it arrives; anything else gets an
+// error and is skipped up to its newline.
+static void client_long_start(client_t *c, char *scratch) {
+    const char *p = line_ring_peek(&c->in, BUF_SIZE, scratch);
+    const char *end = p + BUF_SIZE;
+    const char *q;
+    int kind;
+
+    if (memcmp(p, "MSG ", 4) == 0) {
+        q = p + 4;
+        kind = LONG_MSG;
+    } else if (memcmp(p, "MSGPART ", 8) == 0) {
+        q = p + 8;
+        kind = LONG_PART;
+    } else {
+        send_line(c, "ERR :line too long");
+        c->long_line = LONG_SKIP;
+        return;
+    }
+
+    // the same arguments as MSG's "c?t"
+    while (q < end && *q == ' ') q++;
+    c->long_chan[0] = '\0';
+    if (q < end && *q == '#') {
+        size_t n = 0;
+        while (q < end && *q != ' ') {
+            if (n < sizeof(c->long_chan) - 1) c->long_chan[n++] = *q;
+            q++;
+        }
+        c->long_chan[n] = '\0';
+        while (q < end && *q == ' ') q++;
+    }
+    if (q < end && *q == ':') q++;
+
+    line_ring_drop(&c->in, (size_t)(q - p));
+    c->long_line = kind;
+}
+
+// Passes on one piece of a long MSG or MSGPART; last is set for the end
+// of the line or frame.
+static void client_long_piece(client_t *c, const char *text, size_t len,
+                              int last) {
+    const char *chan = c->long_chan[0] ? c->long_chan : NULL;
+
+    if (c->long_line != LONG_MSG && c->long_line != LONG_PART) return;
+
+    // binary fields can't hold line breaks either
+    int bad = memchr(text, '\0', len) != NULL;
+    if (c->binary && (memchr(text, '\r', len) || memchr(text, '\n', len))) {
+        bad = 1;
+    }
+    if (bad) {
+        send_line(c, c->binary ? "ERR :bad frame" : "ERR :bad line");
+        msg_cut(c);
+        c->long_line = LONG_SKIP;
+    } else if (last && c->long_line == LONG_MSG) {
+        handle_msg(c, chan, text);
+    } else if (len > 0) {
+        handle_msg_part(c, chan, text);
+    }
+}
+
+// Takes the next piece of a long line off c->in. Returns 0 when it has to
+// wait for more input.
+static int client_run_long(client_t *c, char *scratch) {
+    size_t n = line_ring_find(&c->in);
+    size_t take = n ? n : line_ring_len(&c->in);
+    int last = n != 0;
+
+    if (take == 0) return 0;
+    if (take > MSG_PIECE) {
+        take = MSG_PIECE;
+        last = 0;
+    }
+    const char *p = line_ring_peek(&c->in, take, scratch);
+    size_t len = take;
+    if (last) {
+        len--;
+        if (len > 0 && p[len - 1] == '\r') len--;
+    } else if (!n && take == line_ring_len(&c->in) && p[take - 1] == '\r') {
+        // might be the first half of the CRLF; wait for the rest
+        take--;
+        len--;
+    }
+    if (take == 0) return 0;
+
+    if (!client_admit(c)) return 0;
+
+    char text[MSG_PIECE + 1];
+    memcpy(text, p, len);
+    text[len] = '\0';
+    line_ring_drop(&c->in, take);
+    client_charge(c, 0, take);
+
+    client_long_piece(c, text, len, last);
+    if (last) c->long_line = LONG_NONE;
+    return 1;
+}
+
+// A binary frame too long for the input buffer. Like a long line, a MSG
+// or MSGPART frame is sent on in pieces as it arrives, and anything else
+// gets an error and is skipped. Returns 0 when it has to wait for more of
+// the frame's fields.
+static int client_long_frame_start(client_t *c, size_t len, char *scratch) {
+    size_t have = line_ring_len(&c->in);
+    size_t head = 5;                         // length, opcode, field length
+    if (have < head) return 0;
+    const unsigned char *p =
+        (const unsigned char *)line_ring_peek(&c->in, head, scratch);
+    int op = p[2];
+    size_t flen = ((size_t)p[3] << 8) | p[4];
+
+    c->long_line = LONG_SKIP;
+    c->long_chan[0] = '\0';
+    if (op != OP_MSG && op != OP_MSGPART) {
+        send_line(c, "ERR :frame too long");
+        head = 0;
+    } else if (head + flen < len + 2) {
+        // two fields: the channel, then the text
+        if (flen >= CAVE_CHAN_MAX) {
+            send_line(c, "ERR :bad frame");
+            head = 0;
+        } else {
+            if (have < head + flen + 2) return 0;
+            p = (const unsigned char *)line_ring_peek(&c->in, head + flen + 2,
+                                                      scratch);
+            size_t tlen = ((size_t)p[head + flen] << 8) | p[head + flen + 1];
+            if (p[head] != '#' || memchr(p + head, '\0', flen) ||
+                head + flen + 2 + tlen != len + 2) {
+                send_line(c, "ERR :bad frame");
+                head = 0;
+            } else {
+                memcpy(c->long_chan, p + head, flen);
+                c->long_chan[flen] = '\0';
+                head += flen + 2;
+                c->long_line = op == OP_MSG ? LONG_MSG : LONG_PART;
+            }
+        }
+    } else if (head + flen == len + 2) {
+        c->long_line = op == OP_MSG ? LONG_MSG : LONG_PART;
+    } else {
+        send_line(c, "ERR :bad frame");
+        head = 0;
+    }
+
+    client_charge(c, 1, head);               // the rest is charged by the piece
+    line_ring_drop(&c->in, head);
+    c->frame_left = len + 2 - head;
+    return 1;
+}
+
+// Takes the next piece of a long frame off c->in. Returns 0 when it has
+// to wait for more input.
+static int client_run_long_frame(client_t *c, char *scratch) {
+    size_t take = line_ring_len(&c->in);
+    if (take > c->frame_left) take = c->frame_left;
+    if (take > MSG_PIECE) take = MSG_PIECE;
+    if (take == 0 || !client_admit(c)) return 0;
+
+    const char *p = line_ring_peek(&c->in, take, scratch);
+    char text[MSG_PIECE + 1];
+    memcpy(text, p, take);
+    text[take] = '\0';
+    line_ring_drop(&c->in, take);
+    client_charge(c, 0, take);
+    c->frame_left -= take;
+
+    int last = c->frame_left == 0;
+    client_long_piece(c, text, take, last);
+    if (last) c->long_line = LONG_NONE;
+    return 1;
+}
+
+// Runs the complete binary frames waiting in c->in, like
+// client_run_lines() does for text.
+static void client_run_frames(client_t *c) {
+    char scratch[BUF_SIZE];
+
+    while (!c->closing && !c->awaiting) {
+        if (c->frame_left) {
+            if (!client_run_long_frame(c, scratch)) break;
+            continue;
+        }
+        if (line_ring_len(&c->in) < 2) break;
+
+        const unsigned char *p =
+            (const unsigned char *)line_ring_peek(&c->in, 2, scratch);
+        size_t len = ((size_t)p[0] << 8) | p[1];
+        if (len + 2 > BUF_SIZE) {
+            // could never fit in the buffer
+            if (!client_long_frame_start(c, len, scratch)) break;
+            continue;
+        }
+        if (line_ring_len(&c->in) < len + 2) break;
+        if (!client_admit(c)) break;
+
+        p = (const unsigned char *)line_ring_peek(&c->in, len + 2, scratch);
+        line_ring_drop(&c->in, len + 2);
+        client_charge(c, 1, len + 2);
+        handle_binary(c, p + 2, len);
+    }
+}
+
+// Runs the complete lines waiting in c->in. Stops early, leaving the rest
+// buffered, if a command has to wait for another worker.
+static void client_run_lines(client_t *c) {
+    char scratch[BUF_SIZE];
+
+    while (!c->closing && !c->awaiting && !c->binary) {
+        if (c->long_line != LONG_NONE) {
+            if (!client_run_long(c, scratch)) break;
+            continue;
+        }
+
+        if (line_ring_len(&c->in) == 0 || !client_admit(c)) break;
+
+        size_t len;
+        const char *line = line_ring_next(&c->in, scratch, &len);
+        if (!line) {
+            if (line_ring_room(&c->in) > 0) break;
+            client_charge(c, 1, 0);          // the rest is charged by the piece
+            client_long_start(c, scratch);
+            continue;
+        }
+        client_charge(c, 1, len + 1);
+
+        if (len > 0) {
+            handle_command(c, line, len);
+        }
+    }
+
+    if (c->binary) client_run_frames(c);
+}
+
+#ifdef CAVE_USE_URING
+
+// Keeps input that arrives while the client is paused, and cancels the
+// multishot recv so the rest stays in the socket until client_resume().
+static void client_hold(client_t *c, const char *data, size_t len) {
+    if (c->recv_state == RECV_ARMED) {
+        uring_cancel(UOP_RECV, client_handle(c));
+        uring_submit(0);                  // now, not at the end of the tick
+        c->recv_state = RECV_CANCELLING;
+    }
+    if (c->held_len + len > HOLD_MAX) {
+        client_kill(c);
+        return;
+    }
+    if (c->held_len + len > c->held_cap) {
+        size_t cap = c->held_cap ? c->held_cap : 1024;
+        while (cap < c->held_len + len) cap *= 2;
+        char *held = realloc(c->held, cap);
+        if (!held) {
+            client_kill(c);
+            return;
+        }
+        c->held = held;
+        c->held_cap = cap;
+    }
+    memcpy(c->held + c->held_len, data, len);
+    c->held_len += len;
+}
+
+// Takes bytes from a recv completion.
+static void client_feed(client_t *c, const char *data, size_t len) {
+    while (len > 0 && !c->closing) {
+        if (c->awaiting) {
+            client_hold(c, data, len);
+            return;
+        }
+
+        size_t n = line_ring_write(&c->in, data, len);
+        if (n == 0) {
+            // line too long
+            client_kill(c);
+            return;
+        }
+
+        data += n;
+        len -= n;
+
+        client_run_lines(c);
+    }
+}
+
+// Picks up again after a pause: buffered lines first, then held input.
+static void handle_client_data(client_t *c) {
+    client_input_take(c);
+    client_run_lines(c);
+
+    char *held = c->held;
+    size_t len = c->held_len;
+    c->held = NULL;
+    c->held_len = 0;
+    c->held_cap = 0;
+    client_feed(c, held, len);
+    free(held);
+    client_input_put(c);
+
+    if (!c->closing && !c->awaiting && c->recv_state == RECV_IDLE) {
+        uring_arm_recv(c->fd, client_handle(c));
+        c->recv_state = RECV_ARMED;
+    }
+}
+
+#else
+
+// Reads until the socket would block, so it is safe to call from an
+// edge-triggered wakeup. Also used to pick up again after a pause.
+static void handle_client_data(client_t *c) {
+    client_input_take(c);
+    client_run_lines(c);             // anything held back by a pause
+
+    while (!c->closing && !c->awaiting) {
+        struct iovec iov[2];
+        int cnt = line_ring_space(&c->in, iov);
+        if (cnt == 0) {
+            // line too long
+            client_kill(c);
+            break;
+        }
+
+        ssize_t n = readv(c->fd, iov, cnt);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        if (n <= 0) {
+            // disconnect
+            client_kill(c);
+            break;
+        }
+
+        stat_add(&stats->bytes_in, (uint64_t)n);
+        c->last_input = loop_now;
+        line_ring_commit(&c->in, (size_t)n);
+        client_run_lines(c);
+    }
+    client_input_put(c);
+}
+
+#endif // CAVE_USE_URING
+
+// ----------------------- cross-worker messages -----------------------
+
+static void client_resume(client_t *c) {
+    c->awaiting &= ~AWAIT_REPLY;
+    if (!c->awaiting) handle_client_data(c);
+}
+
+static void handle_xmsg(xmsg_t *m) {
+    client_t *c;
+    channel_t *ch;
+    frame_t *f;
+
+    switch (m->type) {
+    case XMSG_BROADCAST:
+        fanout_local(NULL, m->frame);
+        if (m->keep) history_add(&global_history, m->frame);
+        frame_unref(m->frame);
+        break;
+
+    case XMSG_REPLY:
+        c = client_get(m->client);
+        for (uint32_t i = 0; i < m->nframes; i++) {
+            if (c) send_frame(c, m->frames[i]);
+            frame_unref(m->frames[i]);
+        }
+        free(m->frames);
+        if (c) {
+            if (m->frame) send_frame(c, m->frame);
+            client_resume(c);
+        }
+        if (m->frame) frame_unref(m->frame);
+        break;
+
+    case XMSG_NICK_CLAIM:
+        m->ok = nick_index_claim(m->nick, m->worker, m->client);
+        m->type = XMSG_NICK_RESULT;
+        post(m->worker, m);
+        return;
+
+    case XMSG_NICK_RESULT:
+        c = client_get(m->client);
+        if (c) {
+            nick_claim_done(c, m->nick, m->ok);
+            client_resume(c);
+        } else if (m->ok == 1) {
+            // claimed for a client that has left since; give it back
+            m->type = XMSG_NICK_RELEASE;
+            post(nick_partition(m->nick), m);
+            return;
+        }
+        break;
+
+    case XMSG_NICK_RELEASE:
+        nick_index_release(m->nick, m->worker, m->client);
+        break;
+
+    case XMSG_NICK_RESTORE:
+        nick_index_claim(m->nick, m->worker, m->client);
+        break;
+
+    case XMSG_PROFILE_QUERY:
+        // stored since the asker looked?
+        f = store_profile_frame(m->nick);
+        if (!f) f = profile_empty_frame(m->nick, nick_index_find(m->nick) != NULL);
+        post_reply(m, f);
+        return;
+
+    case XMSG_CHANNEL:
+        ch = channel_find(m->chan);
+        if (!ch && m->keep && chan_home(m->chan) == self->id) {
+            ch = channel_create(m->chan);
+        }
+        if (ch) {
+            ch->last_used = ++chan_clock;
+            channel_fanout_local(ch, m->frame);
+            if (m->keep && chan_home(m->chan) == self->id) {
+                history_add(&ch->history, m->frame);
+            }
+            // nothing kept (--history 0) and nobody here to deliver to
+            if (ch->count == 0 && ch->history.count == 0) channel_destroy(ch);
+        }
+        frame_unref(m->frame);
+        break;
+
+    case XMSG_HISTORY_QUERY:
+        ch = channel_find(m->chan);
+        if (ch && ch->history.count) {
+            const history_t *h = &ch->history;
+            uint32_t n = m->count < h->count ? m->count : h->count;
+            m->frames = malloc(n * sizeof(*m->frames));
+            if (m->frames) {
+                uint32_t start = h->head + h->count - n;
+                for (uint32_t i = 0; i < n; i++) {
+                    m->frames[i] =
+                        frame_ref(h->frames[(start + i) % (uint32_t)cfg.history]);
+                }
+                m->nframes = n;
+            }
+        }
+        post_reply(m, history_end_frame(m->chan));
+        return;
+    }
+
+    free(m);
+}
+
+static void worker_drain_inbox(void) {
+    char junk[64];
+    while (read(self->wake_rd, junk, sizeof(junk)) > 0) {}
+    atomic_store(&self->wake_pending, 0);
+
+    xmsg_t *m;
+    while ((m = inbox_pop(self)) != NULL) {
+        handle_xmsg(m);
+        stat_add(&self->xmsg_done, 1);
+    }
+
+#ifdef CAVE_TRACE
+    trace_poll(self->id);
+#endif
+}
+
+// ----------------------- hot upgrade -----------------------
+//
+// SIGUSR1 replaces the running binary without dropping a connection.
+// Worker 0 has every worker pause its clients' input (AWAIT_UPGRADE) and
+// waits until no cross-worker message is left in flight (if that takes
+// longer than UPGRADE_QUIESCE_NS it calls the upgrade off rather than
+// lose one); then each worker writes its clients, and the histories it
+// keeps, as records into its upgrade_out buffer and stops. Worker 0 forks
+// and execs argv[0] again, with UPGRADE_ENV naming one end of a Unix
+// socket, and sends it the listeners, the /metrics socket and the
+// records, every socket as SCM_RIGHTS along with its record. When the new
+// process has it all it answers with one byte and the old one exits;
+// until then both hold the sockets, so clients see neither a close nor a
+// gap, just a short pause. If anything fails before that byte, the old
+// workers carry on.
+//
+// A client record has the nick, channels, pacing and liveness state,
+// unread input (and under io_uring, input held while paused) and unsent
+// output. Profiles need no handing over: they are in the profile store.
+// The new process gives each old worker's clients to the worker with the
+// same number (modulo --threads), claims their nicks without announcing
+// anything and runs whatever complete lines they had waiting.
+
+#define UPGRADE_ENV        "CAVE_UPGRADE_FD"  // set for the new binary
+#define UPGRADE_FD         3                  // where it finds the socket
+#define UPGRADE_MAGIC      0x43415645u        // "CAVE"
+#define UPGRADE_VERSION    2                  // bump when the records change
+#define UPGRADE_QUIESCE_NS (2 * 1000000000ull) // longest wait for replies in flight
+#define UPGRADE_TIMEOUT_S  10                 // for the new binary to take over
+
+enum { UP_IDLE, UP_QUIESCE, UP_FREEZE };
+
+enum {
+    UREC_HELLO = 1,          // upgrade_hello_t, always first
+    UREC_LISTENER,           // u32 number of the worker it was for; socket
+    UREC_METRICS,            // the /metrics listener; socket
+    UREC_CLIENT,             // upgrade_client_t, its input, its output; socket
+    UREC_HISTORY,            // channel name ("" = global), then u32 length + frame each
+    UREC_END,
+};
+
+typedef struct {
+    uint32_t type;                           // UREC_*
+    uint32_t len;                            // payload bytes that follow
+    int32_t fd;                              // sent along as SCM_RIGHTS, or -1
+} upgrade_rec_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t client_size;                    // sizeof(upgrade_client_t)
+    uint32_t workers;
+} upgrade_hello_t;
+
+// Times are CLOCK_MONOTONIC ns, which the two processes share.
+typedef struct {
+    uint32_t worker;                         // the worker it was on
+    uint32_t admin;
+    uint32_t binary;
+    int32_t long_line;
+    int32_t part_skip;
+    uint32_t chan_count;
+    uint64_t part_bytes;
+    uint64_t frame_left;
+    uint64_t out_dropped;
+    uint64_t cmd_tat, byte_tat;
+    uint64_t last_input, ping_sent, nick_due;
+    uint32_t in_len;                         // unread input that follows...
+    uint32_t out_len;                        // ...then unsent output
+    char nick[CAVE_NICK_MAX];
+    char part_chan[CAVE_CHAN_MAX];
+    char long_chan[CAVE_CHAN_MAX];
+    char chans[CAVE_CHANNELS_MAX][CAVE_CHAN_MAX];
+} upgrade_client_t;
+
+static atomic_int upgrade_requested;         // by SIGUSR1
+static atomic_int upgrade_state;             // UP_*
+static atomic_uint upgrade_clients;          // records written
+static char **upgrade_argv;                  // what to exec
+static uint64_t upgrade_deadline;            // worker 0: give up if not settled by then
+static sbuf_t *upgrade_out;                  // records, one buffer per worker
+
+static pthread_mutex_t upgrade_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  upgrade_cond = PTHREAD_COND_INITIALIZER;
+static int upgrade_frozen;                   // workers done writing records
+
+static void upgrade_wake_all(void) {
+    for (int i = 0; i < worker_count; i++) {
+        char b = 1;
+        ssize_t r = write(workers[i].wake_wr, &b, 1);
+        (void)r;
+    }
+}
+
+// Stops running c's input and, under io_uring, receiving it, so whatever
+// is unread stays in the socket for the new process.
+static void upgrade_pause_client(client_t *c) {
+    c->awaiting |= AWAIT_UPGRADE;
+#ifdef CAVE_USE_URING
+    if (c->recv_state == RECV_ARMED) {
+        uring_cancel(UOP_RECV, client_handle(c));
+        c->recv_state = RECV_CANCELLING;
+    }
+#endif
+}
+
+static void upgrade_pause(void) {
+    upgrading = 1;
+    for (size_t i = 0; i < live_count; i++) {
+        upgrade_pause_client(live_clients[i]);
+    }
+#ifdef CAVE_USE_URING
+    if (ring.accept_armed) uring_cancel(UOP_ACCEPT, 0);
+    uring_submit(0);
+#endif
+}
+
+static void upgrade_resume(void) {
+    upgrading = 0;
+#ifdef CAVE_USE_URING
+    if (!ring.accept_armed) uring_arm_accept();
+#endif
+    for (size_t i = 0; i < live_count; i++) {
+        client_t *c = live_clients[i];
+        c->awaiting &= ~AWAIT_UPGRADE;
+        if (!c->closing && !c->awaiting) handle_client_data(c);
+    }
+}
+
+// Whether this worker has nothing under way that stopping would cut
+// short. Under io_uring that means multishot ops and writevs in flight.
+static int upgrade_local_ready(void) {
+#ifdef CAVE_USE_URING
+    if (ring.accept_armed) return 0;
+    for (size_t i = 0; i < live_count; i++) {
+        const client_t *c = live_clients[i];
+        if (!c->closing && (c->recv_state != RECV_IDLE || c->write_blocked)) {
+            return 0;
+        }
+    }
+#endif
+    return 1;
+}
+
+// Worker 0: every worker is ready and every message posted has been
+// handled. The counters only grow, so the same total posted before and
+// after looking means nothing was posted in between.
+static int upgrade_settled(void) {
+    uint64_t posted = 0, done = 0, again = 0;
+    for (int i = 0; i < worker_count; i++) {
+        if (!atomic_load(&workers[i].upgrade_ready)) return 0;
+        posted += stat_get(&workers[i].xmsg_posted);
+    }
+    for (int i = 0; i < worker_count; i++) done += stat_get(&workers[i].xmsg_done);
+    for (int i = 0; i < worker_count; i++) again += stat_get(&workers[i].xmsg_posted);
+    return done == posted && again == posted;
+}
+
+static void upgrade_rec(sbuf_t *b, uint32_t type, size_t len, int fd) {
+    upgrade_rec_t h = { type, (uint32_t)len, fd };
+    sbuf_add(b, &h, sizeof(h));
+}
+
+static void upgrade_save_client(sbuf_t *b, client_t *c) {
+    upgrade_client_t s;
+    memset(&s, 0, sizeof(s));
+    s.worker = (uint32_t)self->id;
+    s.admin = (uint32_t)c->admin;
+    s.binary = (uint32_t)c->binary;
+    s.long_line = c->long_line;
+    s.part_skip = c->part_skip;
+    s.part_bytes = c->part_bytes;
+    s.frame_left = c->frame_left;
+    s.out_dropped = c->out_dropped;
+    s.cmd_tat = c->cmd_tat;
+    s.byte_tat = c->byte_tat;
+    s.last_input = c->last_input;
+    s.ping_sent = c->ping_sent;
+    s.nick_due = c->nick_due;
+    memcpy(s.nick, c->nick, sizeof(s.nick));
+    memcpy(s.part_chan, c->part_chan, sizeof(s.part_chan));
+    memcpy(s.long_chan, c->long_chan, sizeof(s.long_chan));
+    s.chan_count = c->chan_count;
+    for (uint32_t i = 0; i < c->chan_count; i++) {
+        memcpy(s.chans[i], c->chans[i]->name, sizeof(s.chans[i]));
+    }
+
+    size_t in_len = line_ring_len(&c->in);
+    const char *in = in_len ? line_ring_peek(&c->in, in_len, in_scratch) : NULL;
+    size_t held_len = 0;
+#ifdef CAVE_USE_URING
+    held_len = c->held_len;
+#endif
+    s.in_len = (uint32_t)(in_len + held_len);
+    s.out_len = (uint32_t)c->out_bytes;
+
+    upgrade_rec(b, UREC_CLIENT, sizeof(s) + s.in_len + s.out_len, c->fd);
+    sbuf_add(b, &s, sizeof(s));
+    sbuf_add(b, in, in_len);
+#ifdef CAVE_USE_URING
+    sbuf_add(b, c->held, held_len);
+#endif
+    for (uint32_t i = 0; i < c->out_count; i++) {
+        const frame_t *f = c->out_q[(c->out_head + i) & (c->out_cap - 1)];
+        size_t off = i == 0 ? c->out_head_off : 0;
+        sbuf_add(b, f->data + off, f->len - off);
+    }
+    atomic_fetch_add(&upgrade_clients, 1);
+}
+
+static void upgrade_save_history(sbuf_t *b, const char *chan,
+                                 const history_t *h) {
+    if (h->count == 0) return;
+
+    size_t len = CAVE_CHAN_MAX;
+    for (uint32_t i = 0; i < h->count; i++) {
+        len += 4 + h->frames[(h->head + i) % (uint32_t)cfg.history]->len;
+    }
+    char name[CAVE_CHAN_MAX] = "";
+    snprintf(name, sizeof(name), "%s", chan);
+
+    upgrade_rec(b, UREC_HISTORY, len, -1);
+    sbuf_add(b, name, sizeof(name));
+    for (uint32_t i = 0; i < h->count; i++) {
+        const frame_t *f = h->frames[(h->head + i) % (uint32_t)cfg.history];
+        sbuf_add(b, &f->len, 4);
+        sbuf_add(b, f->data, f->len);
+    }
+}
+
+// Writes this worker's clients, and the histories it keeps, to its
+// upgrade_out buffer.
+static void upgrade_save(void) {
+    sbuf_t *b = &upgrade_out[self->id];
+
+    for (size_t i = 0; i < live_count; i++) {
+        client_t *c = live_clients[i];
+#ifdef CAVE_USE_URING
+        // a writev still in flight leaves no telling what was sent; that
+        // connection closes with this process
+        if (c->write_blocked) continue;
+#endif
+        if (!c->closing) upgrade_save_client(b, c);
+    }
+    for (size_t i = 0; i < chan_table_cap; i++) {
+        const channel_t *ch = chan_table[i];
+        if (ch && chan_home(ch->name) == self->id) {
+            upgrade_save_history(b, ch->name, &ch->history);
+        }
+    }
+    if (self->id == 0) upgrade_save_history(b, "", &global_history);
+}
+
+// Sends the records in b, each with its socket if it has one.
+static int upgrade_send(int sock, const sbuf_t *b) {
+    for (size_t off = 0; off < b->len; ) {
+        upgrade_rec_t h;
+        memcpy(&h, b->data + off, sizeof(h));
+
+        struct iovec iov = { b->data + off, sizeof(h) + h.len };
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } ctl;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (h.fd >= 0) {
+            memset(&ctl, 0, sizeof(ctl));
+            msg.msg_control = ctl.buf;
+            msg.msg_controllen = sizeof(ctl.buf);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cm), &h.fd, sizeof(int));
+        }
+        off += iov.iov_len;
+
+        while (iov.iov_len > 0) {
+            ssize_t w = sendmsg(sock, &msg, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            iov.iov_base = (char *)iov.iov_base + w;
+            iov.iov_len -= (size_t)w;
+            msg.msg_control = NULL;          // the socket went with the first part
+            msg.msg_controllen = 0;
+        }
+    }
+    return 0;
+}
+
+// In the forked child: the socket goes to UPGRADE_FD, every other
+// descriptor of ours is closed, and the binary starts over.
+static void upgrade_exec(int sock) {
+    if (sock != UPGRADE_FD && dup2(sock, UPGRADE_FD) < 0) _exit(127);
+
+    long closed = -1;
+#ifdef SYS_close_range
+    closed = syscall(SYS_close_range, UPGRADE_FD + 1, ~0u, 0);
+#endif
+    long max = sysconf(_SC_OPEN_MAX);
+    for (long fd = UPGRADE_FD + 1; closed < 0 && fd < max; fd++) close((int)fd);
+
+    execvp(upgrade_argv[0], upgrade_argv);
+    _exit(127);
+}
+
+// Worker 0, with every worker stopped: starts the new binary and hands
+// it everything. Exits if that worked, returns if not.
+static void upgrade_handoff(void) {
+    sbuf_t head = { NULL, 0, 0, 0 };
+    upgrade_hello_t hello = {
+        UPGRADE_MAGIC, UPGRADE_VERSION, sizeof(upgrade_client_t),
+        (uint32_t)worker_count,
+    };
+    upgrade_rec(&head, UREC_HELLO, sizeof(hello), -1);
+    sbuf_add(&head, &hello, sizeof(hello));
+    for (int i = 0; i < worker_count; i++) {
+        // without SO_REUSEPORT the workers share worker 0's
+        if (i > 0 && workers[i].listen_fd == workers[0].listen_fd) break;
+        uint32_t id = (uint32_t)i;
+        upgrade_rec(&head, UREC_LISTENER, sizeof(id), workers[i].listen_fd);
+        sbuf_add(&head, &id, sizeof(id));
+    }
+    if (metrics_listen_fd >= 0) {
+        upgrade_rec(&head, UREC_METRICS, 0, metrics_listen_fd);
+    }
+    upgrade_rec_t last = { UREC_END, 0, -1 };
+    sbuf_t end = { (char *)&last, sizeof(last), sizeof(last), 0 };
 
-// Profile-related limits
-#define CAVE_NICK_MAX        32
-#define CAVE_DISPLAY_MAX     64
-#define CAVE_BIO_MAX        512
-#define CAVE_PRONOUNS_MAX    16
+    int ok = !head.failed;
+    for (int i = 0; i < worker_count; i++) ok = ok && !upgrade_out[i].failed;
 
-typedef struct {
-    int fd;                                  // socket descriptor
-    char nick[CAVE_NICK_MAX];                // username
-    char display_name[CAVE_DISPLAY_MAX];     // "pretty" name
-    char bio[CAVE_BIO_MAX];                  // custom markup bio
-    char pronouns[CAVE_PRONOUNS_MAX];        // e.g. "he/him, she/her, they/them"
+    int sv[2] = { -1, -1 };
+    pid_t pid = -1;
+    if (ok && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        ok = 0;
+    }
+    if (ok) {
+        char val[16];
+        snprintf(val, sizeof(val), "%d", UPGRADE_FD);
+        setenv(UPGRADE_ENV, val, 1);
+        pid = fork();
+        if (pid == 0) upgrade_exec(sv[1]);
+        unsetenv(UPGRADE_ENV);
+        close(sv[1]);
+        if (pid < 0) {
+            perror("fork");
+            ok = 0;
+        }
+    }
+    if (ok) {
+        struct timeval tv = { UPGRADE_TIMEOUT_S, 0 };
+        setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-    char buf[BUF_SIZE];                      // input buffer
-    size_t buf_len;                          // how much of buf is used
-} client_t;
+        ok = upgrade_send(sv[0], &head) == 0;
+        for (int i = 0; ok && i < worker_count; i++) {
+            ok = upgrade_send(sv[0], &upgrade_out[i]) == 0;
+        }
+        ok = ok && upgrade_send(sv[0], &end) == 0;
 
-static client_t clients[MAX_CLIENTS];
+        char ack;
+        ssize_t r;
+        do r = read(sv[0], &ack, 1); while (r < 0 && errno == EINTR);
+        ok = ok && r == 1;
+    }
+    if (ok) {
+        fprintf(stderr, "upgrade: pid %d took over %u clients\n",
+                (int)pid, atomic_load(&upgrade_clients));
+        fflush(stdout);
+        _exit(0);
+    }
 
-// ----------------------- utility functions -----------------------
+    fprintf(stderr, "upgrade failed, carrying on\n");
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    if (sv[0] >= 0) close(sv[0]);
+    free(head.data);
+}
 
-static void client_init(client_t *c) {
-    c->fd = -1;
-    c->nick[0] = '\0';
-    c->display_name[0] = '\0';
-    c->bio[0] = '\0';
-    c->pronouns[0] = '\0';
-    c->buf_len = 0;
+// Worker 0, once asked: pauses every worker.
+static int upgrade_begin(void) {
+    upgrade_out = calloc((size_t)worker_count, sizeof(*upgrade_out));
+    if (!upgrade_out) {
+        atomic_store(&upgrade_requested, 0);
+        return UP_IDLE;
+    }
+    atomic_store(&upgrade_clients, 0);
+    for (int i = 0; i < worker_count; i++) {
+        atomic_store(&workers[i].upgrade_ready, 0);
+    }
+    upgrade_deadline = loop_now + UPGRADE_QUIESCE_NS;
+    atomic_store(&upgrade_state, UP_QUIESCE);
+    upgrade_wake_all();
+    fprintf(stderr, "upgrade: pausing clients\n");
+    return UP_QUIESCE;
 }
 
-static void send_line(int fd, const char *line) {
-    size_t len = strlen(line);
-    send(fd, line, len, 0);
-    send(fd, "\r\n", 2, 0);
+// Worker 0, when messages are still in flight at the deadline: they
+// would be lost with the old process, so the upgrade is called off.
+static void upgrade_abort(void) {
+    fprintf(stderr, "upgrade: workers still busy, carrying on\n");
+    free(upgrade_out);                       // nothing was written to it yet
+    upgrade_out = NULL;
+    atomic_store(&upgrade_requested, 0);
+    atomic_store(&upgrade_state, UP_IDLE);
+    upgrade_wake_all();
+    upgrade_resume();
 }
 
-static void broadcast_line(int from_fd, const char *line) {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].fd != -1 && clients[i].fd != from_fd) {
-            send_line(clients[i].fd, line);
+// Writes this worker's records and waits: for the rest, on worker 0,
+// which then hands over; elsewhere, for the upgrade to fail (or for the
+// process to end).
+static void upgrade_freeze(void) {
+    upgrade_save();
+
+    pthread_mutex_lock(&upgrade_lock);
+    upgrade_frozen++;
+    pthread_cond_broadcast(&upgrade_cond);
+    if (self->id != 0) {
+        while (atomic_load(&upgrade_state) == UP_FREEZE) {
+            pthread_cond_wait(&upgrade_cond, &upgrade_lock);
         }
+        pthread_mutex_unlock(&upgrade_lock);
+        upgrade_resume();
+        return;
+    }
+    while (upgrade_frozen < worker_count) {
+        pthread_cond_wait(&upgrade_cond, &upgrade_lock);
     }
+    pthread_mutex_unlock(&upgrade_lock);
+
+    upgrade_handoff();
+
+    for (int i = 0; i < worker_count; i++) free(upgrade_out[i].data);
+    free(upgrade_out);
+    upgrade_out = NULL;
+
+    pthread_mutex_lock(&upgrade_lock);
+    upgrade_frozen = 0;
+    atomic_store(&upgrade_requested, 0);
+    atomic_store(&upgrade_state, UP_IDLE);
+    pthread_cond_broadcast(&upgrade_cond);
+    pthread_mutex_unlock(&upgrade_lock);
+    upgrade_resume();
 }
 
-// Find a client by nickname (exact match)
-static client_t *find_client_by_nick(const char *nick) {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].fd != -1 &&
-            clients[i].nick[0] != '\0' &&
-            strcmp(clients[i].nick, nick) == 0) {
-            return &clients[i];
+// Runs at the start of every loop pass.
+static void upgrade_poll(void) {
+    int state = atomic_load(&upgrade_state);
+    if (state == UP_IDLE && self->id == 0 && atomic_load(&upgrade_requested)) {
+        state = upgrade_begin();
+    }
+    if (state == UP_IDLE) {
+        if (upgrading) upgrade_resume();
+        return;
+    }
+
+    if (!upgrading) upgrade_pause();
+    atomic_store(&self->upgrade_ready, upgrade_local_ready());
+
+    if (state == UP_QUIESCE && self->id == 0) {
+        if (upgrade_settled()) {
+            state = UP_FREEZE;
+            atomic_store(&upgrade_state, state);
+            upgrade_wake_all();
+        } else if (loop_now >= upgrade_deadline) {
+            upgrade_abort();
+            return;
         }
     }
-    return NULL;
+    if (state == UP_FREEZE) upgrade_freeze();
 }
 
-// ----------------------- PROFILE command handler -----------------------
+// ----- the new process's side -----
 
-static void handle_profile_command(client_t *c, const char *args) {
-    // args is everything after "PROFILE "
-    // e.g. "SET DISPLAYNAME :Mothman" or "GET mothman"
+static void client_accepted(int cfd, const struct sockaddr_in *peer);
 
-    // trim leading spaces
-    while (*args == ' ') args++;
+#define UPGRADE_ITEM_NEW 0                   // not a record: see upgrade_drain()
 
-    // ----- PROFILE SET -----
-    if (strncmp(args, "SET ", 4) == 0) {
-        const char *p = args + 4;        // skip "SET "
-        while (*p == ' ') p++;          // trim spaces
+typedef struct upgrade_item {
+    struct upgrade_item *next;
+    uint32_t type;                           // UREC_CLIENT, UREC_HISTORY or UPGRADE_ITEM_NEW
+    int fd;                                  // the socket that came with it
+    size_t len;                              // keeps data 8-byte aligned
+    char data[];
+} upgrade_item_t;
 
-        // p now at field name, e.g. DISPLAYNAME / BIO / PRONOUNS
-        char field[32];
-        int n = 0;
-        while (*p && *p != ' ' && *p != ':' && n < (int)sizeof(field) - 1) {
-            field[n++] = *p++;
-        }
-        field[n] = '\0';
+static upgrade_item_t **upgrade_items;       // per worker; NULL unless taking over
+static upgrade_item_t *upgrade_global;       // the global history, for every worker
+static int *upgrade_listeners;               // by old worker number, -1 once taken
+static int upgrade_listener_count;
+static size_t upgrade_taken;                 // clients received
+static int upgrade_in = -1;                  // the old process's socket
+static pthread_barrier_t upgrade_barrier;
 
-        while (*p == ' ') p++;
+static int upgrade_read(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(sock, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
 
-        const char *colon = strchr(p, ':');
-        if (!colon) {
-            send_line(c->fd, "PROFILE ERR SYNTAX");
-            return;
-        }
-        const char *value = colon + 1;
+// The next record's header, and the socket sent with it or -1.
+static int upgrade_recv_head(int sock, upgrade_rec_t *h, int *fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov = { h, sizeof(*h) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
 
-        // trim leading spaces from value
-        while (*value == ' ') value++;
+    ssize_t n;
+    do n = recvmsg(sock, &msg, 0); while (n < 0 && errno == EINTR);
+    if (n <= 0) return -1;
 
-        if (strcasecmp(field, "DISPLAYNAME") == 0) {
-            if (strlen(value) >= CAVE_DISPLAY_MAX) {
-                send_line(c->fd, "PROFILE ERR VALUE_TOO_LONG");
-                return;
-            }
-            snprintf(c->display_name, sizeof(c->display_name), "%s", value);
-            send_line(c->fd, "PROFILE OK DISPLAYNAME");
+    *fd = -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cm), sizeof(int));
+    }
+    return upgrade_read(sock, (char *)h + n, sizeof(*h) - (size_t)n);
+}
 
-        } else if (strcasecmp(field, "BIO") == 0) {
-            if (strlen(value) >= CAVE_BIO_MAX) {
-                send_line(c->fd, "PROFILE ERR VALUE_TOO_LONG");
-                return;
+static void upgrade_keep(upgrade_item_t *it, int worker) {
+    it->next = upgrade_items[worker];
+    upgrade_items[worker] = it;
+}
+
+static int upgrade_add_listener(upgrade_item_t *it) {
+    uint32_t id;
+    if (it->len < sizeof(id) || it->fd < 0) return -1;
+    memcpy(&id, it->data, sizeof(id));
+    if (id >= 1024) return -1;
+
+    if ((int)id >= upgrade_listener_count) {
+        int *l = realloc(upgrade_listeners, (id + 1) * sizeof(*l));
+        if (!l) return -1;
+        for (int i = upgrade_listener_count; i <= (int)id; i++) l[i] = -1;
+        upgrade_listeners = l;
+        upgrade_listener_count = (int)id + 1;
+    }
+    if (upgrade_listeners[id] >= 0) return -1;
+    upgrade_listeners[id] = it->fd;
+    return 0;
+}
+
+static int upgrade_client_ok(upgrade_item_t *it) {
+    upgrade_client_t *s = (upgrade_client_t *)(void *)it->data;
+    if (it->fd < 0 || it->len < sizeof(*s)) return 0;
+    if ((uint64_t)sizeof(*s) + s->in_len + s->out_len != it->len) return 0;
+    if (s->chan_count > CAVE_CHANNELS_MAX) return 0;
+    if (s->frame_left > 0xffff + 2) return 0;
+    if (s->long_line < LONG_NONE || s->long_line > LONG_PART) return 0;
+    if (s->part_skip != 0 && s->part_skip != 1) return 0;
+
+    s->nick[CAVE_NICK_MAX - 1] = '\0';
+    s->part_chan[CAVE_CHAN_MAX - 1] = '\0';
+    s->long_chan[CAVE_CHAN_MAX - 1] = '\0';
+    for (uint32_t i = 0; i < s->chan_count; i++) {
+        s->chans[i][CAVE_CHAN_MAX - 1] = '\0';
+    }
+    return 1;
+}
+
+// Reads everything the old process sends, up to UREC_END, and sorts it
+// out by the worker that is to take it.
+static int upgrade_receive(int sock) {
+    upgrade_items = calloc((size_t)worker_count, sizeof(*upgrade_items));
+    if (!upgrade_items) return -1;
+
+    int hello = 0;
+    for (;;) {
+        upgrade_rec_t h;
+        int fd;
+        if (upgrade_recv_head(sock, &h, &fd) < 0) return -1;
+
+        upgrade_item_t *it = malloc(sizeof(*it) + h.len);
+        if (!it || upgrade_read(sock, it->data, h.len) < 0) return -1;
+        it->type = h.type;
+        it->fd = fd;
+        it->len = h.len;
+        if (!hello && h.type != UREC_HELLO) return -1;
+
+        switch (h.type) {
+        case UREC_HELLO: {
+            upgrade_hello_t hi;
+            if (h.len < sizeof(hi)) return -1;
+            memcpy(&hi, it->data, sizeof(hi));
+            if (hi.magic != UPGRADE_MAGIC || hi.version != UPGRADE_VERSION ||
+                hi.client_size != sizeof(upgrade_client_t)) {
+                fprintf(stderr, "upgrade: the running server is incompatible\n");
+                return -1;
             }
-            snprintf(c->bio, sizeof(c->bio), "%s", value);
-            send_line(c->fd, "PROFILE OK BIO");
+            hello = 1;
+            free(it);
+            break;
+        }
 
-        } else if (strcasecmp(field, "PRONOUNS") == 0) {
-            if (strlen(value) >= CAVE_PRONOUNS_MAX) {
-                send_line(c->fd, "PROFILE ERR VALUE_TOO_LONG");
-                return;
+        case UREC_LISTENER:
+            if (upgrade_add_listener(it) < 0) return -1;
+            free(it);
+            break;
+
+        case UREC_METRICS:
+            metrics_listen_fd = fd;
+            free(it);
+            break;
+
+        case UREC_CLIENT:
+            if (!upgrade_client_ok(it)) return -1;
+            upgrade_keep(it, (int)(((upgrade_client_t *)(void *)it->data)->worker %
+                                   (uint32_t)worker_count));
+            upgrade_taken++;
+            break;
+
+        case UREC_HISTORY:
+            if (h.len < CAVE_CHAN_MAX) return -1;
+            it->data[CAVE_CHAN_MAX - 1] = '\0';
+            if (it->data[0]) {
+                upgrade_keep(it, chan_home(it->data));
+            } else {
+                free(upgrade_global);
+                upgrade_global = it;
             }
-            snprintf(c->pronouns, sizeof(c->pronouns), "%s", value);
-            send_line(c->fd, "PROFILE OK PRONOUNS");
+            break;
 
-        } else {
-            send_line(c->fd, "PROFILE ERR FIELD");
+        case UREC_END:
+            free(it);
+            return 0;
+
+        default:                             // from a newer binary; skip it
+            if (fd >= 0) close(fd);
+            free(it);
+            break;
         }
+    }
+}
 
-    // ----- PROFILE GET -----
-    } else if (strncmp(args, "GET ", 4) == 0) {
-        const char *p = args + 4;
-        while (*p == ' ') p++;
+// The listener the old process's worker id had, if any. Each is handed
+// out once; a new --backlog applies to it too.
+static int upgrade_listener(int id) {
+    if (id >= upgrade_listener_count) return -1;
+    int fd = upgrade_listeners[id];
+    upgrade_listeners[id] = -1;
+    if (fd >= 0) listen(fd, (int)cfg.backlog);
+    return fd;
+}
+
+// A listener left over when --threads went down: the connections in its
+// queue are taken and shared out among the workers, to be set up as if
+// just accepted, before it is closed. One that arrives between the last
+// accept() and the close() is reset; SO_REUSEPORT sends no more after.
+static void upgrade_drain(int fd) {
+    static int next_worker;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    for (;;) {
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd < 0 && errno == EINTR) continue;
+        if (cfd < 0) break;
 
-        char target_nick[CAVE_NICK_MAX];
-        int n = 0;
-        while (*p && *p != ' ' && *p != '\r' && *p != '\n' &&
-               n < (int)sizeof(target_nick) - 1) {
-            target_nick[n++] = *p++;
+        upgrade_item_t *it = malloc(sizeof(*it));
+        if (!it) {
+            close(cfd);
+            continue;
         }
-        target_nick[n] = '\0';
+        it->type = UPGRADE_ITEM_NEW;
+        it->fd = cfd;
+        it->len = 0;
+        upgrade_keep(it, next_worker);
+        next_worker = (next_worker + 1) % worker_count;
+    }
+    close(fd);
+}
 
-        if (target_nick[0] == '\0') {
-            send_line(c->fd, "PROFILE ERR SYNTAX");
-            return;
+// Tells the old process everything arrived; it exits on that.
+static int upgrade_ack(int sock) {
+    // listeners left over when --threads went down, and /metrics if it's off
+    for (int i = 0; i < upgrade_listener_count; i++) {
+        if (upgrade_listeners[i] >= 0) upgrade_drain(upgrade_listeners[i]);
+    }
+    free(upgrade_listeners);
+    upgrade_listeners = NULL;
+    upgrade_listener_count = 0;
+    if (!cfg.metrics_port && metrics_listen_fd >= 0) {
+        close(metrics_listen_fd);
+        metrics_listen_fd = -1;
+    }
+
+    if (pthread_barrier_init(&upgrade_barrier, NULL, (unsigned)worker_count) != 0) {
+        return -1;
+    }
+    char ack = 1;
+    if (write(sock, &ack, 1) != 1) return -1;
+    close(sock);
+    return 0;
+}
+
+static void upgrade_restore_history(const upgrade_item_t *it) {
+    history_t *h = &global_history;
+    channel_t *ch = NULL;
+    if (it->data[0]) {
+        ch = channel_find(it->data);
+        if (!ch) ch = channel_create(it->data);
+        if (!ch) return;
+        h = &ch->history;
+    }
+
+    for (size_t off = CAVE_CHAN_MAX; off + 4 <= it->len; ) {
+        uint32_t len;
+        memcpy(&len, it->data + off, 4);
+        off += 4;
+        if (len > it->len - off) break;
+
+        frame_t *f = frame_alloc(len);
+        if (!f) break;
+        memcpy(f->data, it->data + off, len);
+        history_add(h, f);
+        frame_unref(f);
+        off += len;
+    }
+    if (ch && ch->count == 0 && ch->history.count == 0) channel_destroy(ch);
+}
+
+// Claims c's nick back in its partition, without anyone being told.
+static void upgrade_restore_nick(client_t *c) {
+    int p = nick_partition(c->nick);
+    if (p == self->id) {
+        nick_index_claim(c->nick, self->id, client_handle(c));
+        return;
+    }
+
+    xmsg_t *m = xmsg_new(XMSG_NICK_RESTORE);
+    if (!m) return;
+    m->worker = self->id;
+    m->client = client_handle(c);
+    snprintf(m->nick, sizeof(m->nick), "%s", c->nick);
+    post(p, m);
+}
+
+static void upgrade_restore_client(const upgrade_item_t *it) {
+    upgrade_client_t s;
+    memcpy(&s, it->data, sizeof(s));
+    const char *in = it->data + sizeof(s);
+    const char *out = in + s.in_len;
+    int fd = it->fd;
+
+    // non-blocking, except under io_uring (see client_accepted())
+    int fl = fcntl(fd, F_GETFL);
+#ifdef CAVE_USE_URING
+    fcntl(fd, F_SETFL, fl & ~O_NONBLOCK);
+#else
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+#endif
+
+    client_t *c = client_alloc(fd);
+    if (!c || loop_add(fd, client_handle(c), 1) < 0) {
+        if (c) client_free(c);
+        close(fd);
+        return;
+    }
+    stat_add(&stats->accepted, 1);           // cave_clients is accepted - closed
+    c->admin = s.admin != 0 && cfg.admin_local;
+    c->binary = s.binary != 0;
+    c->long_line = s.long_line;
+    c->part_skip = s.part_skip;
+    c->part_bytes = s.part_bytes;
+    c->frame_left = s.frame_left;
+    c->out_dropped = s.out_dropped;
+    c->cmd_tat = s.cmd_tat;
+    c->byte_tat = s.byte_tat;
+    c->last_input = s.last_input;
+    c->ping_sent = s.ping_sent;
+    c->nick_due = s.nick_due;
+    snprintf(c->part_chan, sizeof(c->part_chan), "%s", s.part_chan);
+    snprintf(c->long_chan, sizeof(c->long_chan), "%s", s.long_chan);
+    if (s.nick[0]) {
+        snprintf(c->nick, sizeof(c->nick), "%s", s.nick);
+        upgrade_restore_nick(c);
+    }
+
+    for (uint32_t i = 0; i < s.chan_count; i++) {
+        channel_t *ch = channel_find(s.chans[i]);
+        if (!ch) ch = channel_create(s.chans[i]);
+        if (ch && channel_add(ch, c) < 0 && ch->count == 0 &&
+            ch->history.count == 0) {
+            channel_destroy(ch);
         }
+    }
 
-        client_t *target = find_client_by_nick(target_nick);
-        if (!target) {
-            char line[128];
-            snprintf(line, sizeof(line),
-                     "PROFILE ERR NOTFOUND %s", target_nick);
-            send_line(c->fd, line);
-            return;
+    line_ring_init(&c->in, in_scratch, BUF_SIZE);
+    size_t n = line_ring_write(&c->in, in, s.in_len);
+    if (n < s.in_len) {
+#ifdef CAVE_USE_URING
+        c->held = malloc(s.in_len - n);
+        if (c->held) {
+            memcpy(c->held, in + n, s.in_len - n);
+            c->held_len = c->held_cap = s.in_len - n;
+        } else {
+            client_kill(c);
         }
+#else
+        client_kill(c);                      // held input from an io_uring build
+#endif
+    }
+    client_input_put(c);
+
+    if (s.out_len) {
+        frame_t *f = frame_alloc(s.out_len);
+        if (f) memcpy(f->data, out, s.out_len);
+        if (!f || out_push(c, f, 0) < 0) client_kill(c);
+        else mark_dirty(c);
+        if (f) frame_unref(f);
+    }
+
+    wheel_arm(&c->live_timer, loop_now, client_live_fire);
+    client_defer(c, 0);                      // run what is waiting, first pass
+}
+
+// A connection from a dropped listener's queue (see upgrade_drain()).
+static void upgrade_restore_new(int fd) {
+    // non-blocking, except under io_uring (see client_accepted())
+    int fl = fcntl(fd, F_GETFL);
+#ifdef CAVE_USE_URING
+    fcntl(fd, F_SETFL, fl & ~O_NONBLOCK);
+#else
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+#endif
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    client_accepted(fd, NULL);
+}
 
-        char line[BUF_SIZE];
+// Worker start-up after taking over: this worker's share of clients and
+// histories. Nobody runs a command until every worker is through, so
+// the restored nicks are claimed (or queued to be) ahead of any NICK.
+static void upgrade_restore(void) {
+    if (upgrade_global) upgrade_restore_history(upgrade_global);
 
-        if (target->display_name[0]) {
-            snprintf(line, sizeof(line),
-                     "PROFILE DATA %s DISPLAYNAME :%s",
-                     target->nick, target->display_name);
-            send_line(c->fd, line);
+    upgrade_item_t *it = upgrade_items[self->id];
+    while (it) {
+        upgrade_item_t *next = it->next;
+        if (it->type == UREC_CLIENT) {
+            upgrade_restore_client(it);
+        } else if (it->type == UPGRADE_ITEM_NEW) {
+            upgrade_restore_new(it->fd);
+        } else {
+            upgrade_restore_history(it);
         }
+        free(it);
+        it = next;
+    }
+    upgrade_items[self->id] = NULL;
+
+    pthread_barrier_wait(&upgrade_barrier);
+    if (self->id == 0) {
+        free(upgrade_global);
+        upgrade_global = NULL;
+    }
+}
+
+// ----------------------- main server loop -----------------------
+
+// Connection capacity is bounded by the descriptor limit, so lift the soft
+// limit as far as the hard limit allows.
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options]\n\n", argv0);
+    for (size_t i = 0; i < NUM_OPTIONS; i++) {
+        fprintf(stderr, "  --%-14s %s\n", options[i].name, options[i].help);
+    }
+}
+
+static int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) return -1;
+
+        const char *name = argv[i] + 2;
+        const char *eq = strchr(name, '=');
+        size_t name_len = eq ? (size_t)(eq - name) : strlen(name);
 
-        if (target->pronouns[0]) {
-            snprintf(line, sizeof(line),
-                     "PROFILE DATA %s PRONOUNS :%s",
-                     target->nick, target->pronouns);
-            send_line(c->fd, line);
+        const option_t *opt = NULL;
+        for (size_t o = 0; o < NUM_OPTIONS; o++) {
+            if (strlen(options[o].name) == name_len &&
+                strncmp(options[o].name, name, name_len) == 0) {
+                opt = &options[o];
+                break;
+            }
         }
+        if (!opt) return -1;
+
+        const char *value = eq ? eq + 1 : argv[++i];
+        if (!value) return -1;
 
-        if (target->bio[0]) {
-            snprintf(line, sizeof(line),
-                     "PROFILE DATA %s BIO :%s",
-                     target->nick, target->bio);
-            send_line(c->fd, line);
+        if (opt->num) {
+            char *end;
+            long v = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || v < 0) return -1;
+            *opt->num = v;
+        } else {
+            *opt->str = value;
         }
+    }
 
-        snprintf(line, sizeof(line),
-                 "PROFILE END %s", target->nick);
-        send_line(c->fd, line);
+    if (strcmp(cfg.slow_policy, "disconnect") == 0) {
+        cfg.slow_mode = SLOW_DISCONNECT;
+    } else if (strcmp(cfg.slow_policy, "drop") == 0) {
+        cfg.slow_mode = SLOW_DROP;
+    } else {
+        return -1;
+    }
 
+    if (strcmp(cfg.flood_policy, "throttle") == 0) {
+        cfg.flood_mode = FLOOD_THROTTLE;
+    } else if (strcmp(cfg.flood_policy, "disconnect") == 0) {
+        cfg.flood_mode = FLOOD_DISCONNECT;
     } else {
-        send_line(c->fd, "PROFILE ERR SYNTAX");
+        return -1;
     }
+    if (cfg.cmd_rate < 0 || cfg.cmd_rate > 1000000000 || cfg.cmd_burst < 1) return -1;
+    if (cfg.byte_rate < 0 || cfg.byte_rate > 1000000000 || cfg.byte_burst < 1) return -1;
+    if (cfg.tick_lines < 0) return -1;
+    if (cfg.idle_timeout < 0 || cfg.idle_timeout > WHEEL_MAX_S) return -1;
+    if (cfg.pong_timeout < 1 || cfg.pong_timeout > WHEEL_MAX_S) return -1;
+    if (cfg.nick_timeout < 0 || cfg.nick_timeout > WHEEL_MAX_S) return -1;
+    cfg.cmd_ns = cfg.cmd_rate ? 1000000000u / (uint64_t)cfg.cmd_rate : 0;
+    cfg.byte_ns = cfg.byte_rate ? 1000000000u / (uint64_t)cfg.byte_rate : 0;
+
+    if (cfg.port <= 0 || cfg.port > 65535) return -1;
+    if (cfg.threads < 1 || cfg.threads > 1024) return -1;
+    if (cfg.backlog < 1 || cfg.backlog > 65535) return -1;
+    if (cfg.history > HISTORY_LIMIT) return -1;
+    if (cfg.max_channels < 1) return -1;
+    if (cfg.max_message < 1 || cfg.max_message > MAX_MESSAGE_LIMIT) return -1;
+    if (cfg.max_display < 1 || cfg.max_display > PROFILE_FIELD_LIMIT) return -1;
+    if (cfg.max_pronouns < 1 || cfg.max_pronouns > PROFILE_FIELD_LIMIT) return -1;
+    if (cfg.max_bio < 1 || cfg.max_bio > PROFILE_FIELD_LIMIT) return -1;
+    if (cfg.metrics_port < 0 || cfg.metrics_port > 65535) return -1;
+    if (cfg.admin_local != 0 && cfg.admin_local != 1) return -1;
+    return 0;
 }
 
-// ----------------------- main command handler -----------------------
+#ifdef CAVE_USE_URING
 
-static void handle_command(client_t *c, const char *line) {
-    if (strncmp(line, "NICK ", 5) == 0) {
-        snprintf(c->nick, sizeof(c->nick), "%s", line + 5);
-        char msg[128];
-        snprintf(msg, sizeof(msg),
-                 "SYS :%s joined",
-                 c->nick[0] ? c->nick : "anonymous");
-        broadcast_line(c->fd, msg);
-        send_line(c->fd, "SYS :nickname set");
-
-    } else if (strncmp(line, "MSG ", 4) == 0) {
-        const char *text = line + 4;
-        const char *colon = strchr(text, ':');
-        if (colon) {
-            colon++;
-        } else {
-            colon = text;
+// A client with a writev in flight stays until its completion arrives, as
+// the kernel may still be reading its frames. shutdown() makes that quick.
+static void reap_dead_clients(void) {
+    size_t kept = 0;
+    for (size_t i = 0; i < dead_count; i++) {
+        client_t *c = dead_clients[i];
+        if (c->write_blocked) {
+            shutdown(c->fd, SHUT_RDWR);
+            dead_clients[kept++] = c;
+            continue;
         }
+        client_disconnect(c);
+    }
+    dead_count = kept;
+}
 
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof(msg),
-                 "MSG @%s :%s",
-                 c->nick[0] ? c->nick : "anon",
-                 colon);
-        broadcast_line(c->fd, msg);
-        send_line(c->fd, msg);
+#else
 
-    } else if (strcmp(line, "PING") == 0) {
-        send_line(c->fd, "PONG");
+static void reap_dead_clients(void) {
+    for (size_t i = 0; i < dead_count; i++) {
+        client_disconnect(dead_clients[i]);
+    }
+    dead_count = 0;
+}
 
-    } else if (strncmp(line, "PROFILE ", 8) == 0) {
-        handle_profile_command(c, line + 8);
+#endif
 
-    } else {
-        send_line(c->fd, "ERR :unknown command");
+// held in reserve so we can still turn clients away at the fd limit
+static _Thread_local int spare_fd = -1;
+
+// Out of descriptors: the listener would stay readable forever, so use
+// the spare fd to accept and refuse. Returns -1 if there was nothing to
+// refuse, or no spare.
+static int accept_refuse(void) {
+    if (spare_fd < 0) return -1;
+    close(spare_fd);
+    int cfd = accept(self->listen_fd, NULL, NULL);
+    if (cfd >= 0) {
+        stat_add(&stats->rejected, 1);
+        reject_full(cfd);
     }
+    spare_fd = open("/dev/null", O_RDONLY);
+    return cfd >= 0 ? 0 : -1;
 }
 
-// ----------------------- socket read loop per client -----------------------
+// peer is where the connection is from, if accept() said; NULL looks it
+// up. Client sockets are non-blocking (see accept_client()), except under
+// io_uring: there a writev on an O_NONBLOCK socket fails with EAGAIN
+// rather than waiting for room.
+static void client_accepted(int cfd, const struct sockaddr_in *peer) {
+    client_t *c = client_alloc(cfd);
+    if (!c || loop_add(cfd, client_handle(c), 1) < 0) {
+        if (c) client_free(c);
+        stat_add(&stats->rejected, 1);
+        reject_full(cfd);
+        return;
+    }
+    stat_add(&stats->accepted, 1);
 
-static void handle_client_data(client_t *c) {
-    char *buf = c->buf;
-    ssize_t n = recv(c->fd,
-                     buf + c->buf_len,
-                     BUF_SIZE - c->buf_len - 1,
-                     0);
-
-    if (n <= 0) {
-        // disconnect
-        close(c->fd);
-        client_init(c);
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    if (!peer && getpeername(cfd, (struct sockaddr *)&addr, &alen) == 0) {
+        peer = &addr;
+    }
+    if (cfg.admin_local && peer && peer->sin_family == AF_INET &&
+        (ntohl(peer->sin_addr.s_addr) >> 24) == 127) {
+        c->admin = 1;
+    }
+
+    client_live_start(c);
+    send_line(c, "WELCOME CAVE/0.1");
+    if (upgrading) upgrade_pause_client(c);
+}
+
+#ifndef CAVE_USE_URING
+
+// A pending connection as a non-blocking socket, or -1. accept4() does
+// it in one call; elsewhere it takes an fcntl() after.
+static int accept_client(int listen_fd, struct sockaddr_in *peer) {
+    socklen_t len = sizeof(*peer);
+#ifdef __linux__
+    return accept4(listen_fd, (struct sockaddr *)peer, &len,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int cfd = accept(listen_fd, (struct sockaddr *)peer, &len);
+    if (cfd >= 0 && fcntl(cfd, F_SETFL, O_NONBLOCK) < 0) {
+        close(cfd);
+        return -1;
+    }
+    return cfd;
+#endif
+}
+
+// Takes connections until the backlog is empty or cfg.accept_batch of
+// them have been taken. The listener is level-triggered, so whatever is
+// left wakes the next pass, once the clients have had their turn.
+static void handle_accept(void) {
+    TRACE_BEGIN(t);
+    for (long n = 0; cfg.accept_batch == 0 || n < cfg.accept_batch; n++) {
+        struct sockaddr_in peer;
+        int cfd = accept_client(self->listen_fd, &peer);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if ((errno == EMFILE || errno == ENFILE) && accept_refuse() == 0) {
+                continue;
+            }
+            break;                        // EAGAIN: nothing more waiting
+        }
+        client_accepted(cfd, &peer);
+    }
+    TRACE_END(t, "accept");
+}
+
+#else
+
+// Resolves the tag bits of a completion's user_data (see uring_ud()).
+static client_t *uring_client(uint64_t ud) {
+    uint32_t slot = (uint32_t)ud;
+    uint32_t gen = (uint32_t)(ud >> 32) & 0xFFFFFF;
+    if (slot >= client_slab_count * CLIENT_SLAB_SIZE) return NULL;
+    client_t *c = client_slot(slot);
+    if (c->fd == -1 || (c->gen & 0xFFFFFF) != gen) return NULL;
+    return c;
+}
+
+static void client_send_done(client_t *c, int res) {
+    c->write_blocked = 0;
+    if (c->closing) return;
+    if (res < 0) {
+        client_kill(c);
         return;
     }
 
-    c->buf_len += (size_t)n;
-    buf[c->buf_len] = '\0';
+    stat_add(&stats->bytes_out, (uint64_t)res);
+    out_consume(c, (size_t)res);
+    if (c->out_count) mark_dirty(c);      // short write, or more queued
+    else out_drained(c);
+}
 
-    char *start = buf;
-    for (;;) {
-        char *newline = strstr(start, "\n");
-        if (!newline) break;
+static void uring_complete(const struct io_uring_cqe *cqe) {
+    int op = (int)(cqe->user_data >> 56);
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    client_t *c;
 
-        *newline = '\0';
-        if (newline > start && *(newline - 1) == '\r') {
-            *(newline - 1) = '\0';
+    switch (op) {
+    case UOP_ACCEPT:
+        if (cqe->res >= 0) {
+            TRACE_BEGIN(t);
+            client_accepted(cqe->res, NULL);
+            TRACE_END(t, "accept");
+        } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+            accept_refuse();
+        }
+        if (!more) {
+            ring.accept_armed = 0;
+            if (!upgrading) uring_arm_accept();   // see upgrade_pause()
         }
+        break;
 
-        if (*start != '\0') {
-            handle_command(c, start);
+    case UOP_WAKE:
+        worker_drain_inbox();
+        if (!more) uring_arm_wake();
+        break;
+
+    case UOP_RECV:
+        c = uring_client(cqe->user_data);
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (c && !c->closing && cqe->res > 0) {
+                TRACE_BEGIN(t);
+                stat_add(&stats->bytes_in, (uint64_t)cqe->res);
+                c->last_input = loop_now;
+                client_input_take(c);
+                client_feed(c, ring.bufs + (size_t)bid * URING_BUF_SIZE,
+                            (size_t)cqe->res);
+                client_input_put(c);
+                TRACE_END(t, "handle_client_data");
+            }
+            uring_buf_add(bid);
         }
+        if (!c || c->closing || more) break;
+        if (cqe->res == 0 ||
+            (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+            // disconnect
+            client_kill(c);
+        } else if (c->recv_state == RECV_ARMED && !c->awaiting) {
+            uring_arm_recv(c->fd, client_handle(c));
+        } else {
+            c->recv_state = RECV_IDLE;
+            if (!c->awaiting) handle_client_data(c);    // resumed meanwhile
+        }
+        break;
 
-        start = newline + 1;
+    case UOP_SEND:
+        c = uring_client(cqe->user_data);
+        if (c) client_send_done(c, cqe->res);
+        break;
     }
+}
+
+// The worker loop for io_uring: one io_uring_enter() per tick submits the
+// flushes queued last tick and waits for the next completion.
+static void uring_loop(void) {
+    for (;;) {
+        if (uring_wait(loop_idle_ns()) < 0 && errno != EINTR && errno != ETIME) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+        loop_begin_tick();
+        upgrade_poll();
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        // Sends first: a finished writev lets its client be written to
+        // directly while the rest of the batch fans out to it.
+        for (unsigned i = head; i != tail; i++) {
+            struct io_uring_cqe *cqe = &ring.cqes[i & *ring.cq_mask];
+            if ((cqe->user_data >> 56) == UOP_SEND) uring_complete(cqe);
+        }
+        for (unsigned i = head; i != tail; i++) {
+            struct io_uring_cqe *cqe = &ring.cqes[i & *ring.cq_mask];
+            if ((cqe->user_data >> 56) != UOP_SEND) uring_complete(cqe);
+        }
+        __atomic_store_n(ring.cq_head, tail, __ATOMIC_RELEASE);
 
-    size_t remaining = c->buf + c->buf_len - start;
-    memmove(c->buf, start, remaining);
-    c->buf_len = remaining;
+        flush_dirty_clients();
+        reap_dead_clients();
+        flush_dirty_clients();      // anything the reaped clients left others
+    }
 }
 
-// ----------------------- main server loop -----------------------
+#endif // CAVE_USE_URING
+
+static void *worker_main(void *arg) {
+    self = arg;
+    stats = &self->stats;
+#ifdef CAVE_TRACE
+    trace = calloc(1, sizeof(*trace));      // tracing just stays off without it
+#endif
+
+    spare_fd = open("/dev/null", O_RDONLY);
+    wheel_init();
+    loop_now = now_ns();
+
+    if (loop_init() < 0 ||
+        loop_add(self->listen_fd, LISTEN_TAG, 0) < 0 ||
+        loop_add(self->wake_rd, WAKE_TAG, 0) < 0) {
+        perror("event loop");
+        exit(1);
+    }
+    if (upgrade_items) upgrade_restore();
 
-int main(void) {
+#ifdef CAVE_USE_URING
+    uring_loop();
+#else
+    loop_event_t events[MAX_EVENTS];
+
+    for (;;) {
+        int ready = loop_wait(events, MAX_EVENTS, loop_idle_ns());
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("loop_wait");
+            exit(1);
+        }
+        loop_begin_tick();
+        upgrade_poll();
+
+        for (int e = 0; e < ready; e++) {
+            // new connection
+            if (events[e].tag == LISTEN_TAG) {
+                handle_accept();
+                continue;
+            }
+
+            // messages from other workers
+            if (events[e].tag == WAKE_TAG) {
+                worker_drain_inbox();
+                continue;
+            }
+
+            // existing client
+            client_t *c = client_get(events[e].tag);
+            if (!c) continue;    // dropped earlier this wakeup
+
+            if ((events[e].events & EV_WRITE) && c->write_blocked) {
+                client_flush(c);
+            }
+            if (events[e].events & (EV_READ | EV_HUP)) {
+                TRACE_BEGIN(t);
+                handle_client_data(c);
+                TRACE_END(t, "handle_client_data");
+            }
+        }
+
+        flush_dirty_clients();
+        reap_dead_clients();
+        flush_dirty_clients();      // anything the reaped clients left others
+    }
+#endif
+
+    return NULL;
+}
+
+// Every worker gets its own listening socket on the same port; the kernel
+// balances incoming connections across them. Without SO_REUSEPORT all
+// workers share worker 0's socket instead.
+static int open_listener(void) {
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0) {
         perror("socket");
-        return 1;
+        return -1;
     }
 
     int opt = 1;
     setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#endif
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(CAVE_PORT);
+    addr.sin_port = htons((uint16_t)cfg.port);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("bind");
         close(listen_fd);
-        return 1;
+        return -1;
     }
 
-    if (listen(listen_fd, 8) < 0) {
+    if (listen(listen_fd, (int)cfg.backlog) < 0) {
         perror("listen");
         close(listen_fd);
+        return -1;
+    }
+
+    // several loops may wake for one connection; losers must not block
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    return listen_fd;
+}
+
+static int worker_setup(worker_t *w, int id) {
+    w->id = id;
+    inbox_init(w);
+    atomic_init(&w->wake_pending, 0);
+
+    w->listen_fd = upgrade_listener(id);
+    if (w->listen_fd < 0) {
+#ifdef SO_REUSEPORT
+        w->listen_fd = open_listener();
+#else
+        w->listen_fd = id == 0 ? open_listener() : workers[0].listen_fd;
+#endif
+    }
+    if (w->listen_fd < 0) return -1;
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    w->wake_rd = fds[0];
+    w->wake_wr = fds[1];
+    return 0;
+}
+
+// SIGUSR1: hands over to a fresh copy of the binary (see upgrade_poll()).
+static void upgrade_signal(int sig) {
+    (void)sig;
+    atomic_store(&upgrade_requested, 1);
+    char b = 1;
+    ssize_t r = write(workers[0].wake_wr, &b, 1);
+    (void)r;
+}
+
+#ifdef CAVE_TRACE
+// SIGUSR2: has every worker dump its trace ring (see trace_poll()).
+static void trace_signal(int sig) {
+    (void)sig;
+    atomic_fetch_add(&trace_gen, 1);
+    for (int i = 0; i < worker_count; i++) {
+        char b = 1;
+        ssize_t r = write(workers[i].wake_wr, &b, 1);
+        (void)r;
+    }
+}
+#endif
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) < 0) {
+        usage(argv[0]);
         return 1;
     }
 
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        client_init(&clients[i]);
+    // a peer that resets mid-send shows up as EPIPE, not a fatal signal
+    signal(SIGPIPE, SIG_IGN);
+
+    raise_fd_limit();
+
+    if (cmd_index_init() < 0) {
+        fprintf(stderr, "no perfect hash for the command table\n");
+        return 1;
     }
 
-    printf("CAVE server listening on port %d\n", CAVE_PORT);
+    if (store_open(cfg.profile_store) < 0) {
+        perror(cfg.profile_store);
+        return 1;
+    }
 
-    for (;;) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(listen_fd, &rfds);
-        int maxfd = listen_fd;
-
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (clients[i].fd != -1) {
-                FD_SET(clients[i].fd, &rfds);
-                if (clients[i].fd > maxfd) maxfd = clients[i].fd;
-            }
-        }
+    worker_count = (int)cfg.threads;
+    workers = calloc((size_t)worker_count, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
 
-        int ready = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-        if (ready < 0) {
-            if (errno == EINTR) continue;
-            perror("select");
-            break;
+    // started by a running server's hot upgrade: take its sockets first
+    upgrade_argv = argv;
+    const char *up = getenv(UPGRADE_ENV);
+    if (up) {
+        upgrade_in = atoi(up);
+        unsetenv(UPGRADE_ENV);
+        if (upgrade_receive(upgrade_in) < 0) {
+            fprintf(stderr, "upgrade: could not take over\n");
+            return 1;
         }
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (worker_setup(&workers[i], i) < 0) return 1;
+    }
 
-        // new connection
-        if (FD_ISSET(listen_fd, &rfds)) {
-            struct sockaddr_in caddr;
-            socklen_t clen = sizeof(caddr);
-            int cfd = accept(listen_fd, (struct sockaddr *)&caddr, &clen);
-            if (cfd >= 0) {
-                int assigned = 0;
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (clients[i].fd == -1) {
-                        clients[i].fd = cfd;
-                        clients[i].buf_len = 0;
-                        clients[i].nick[0] = '\0';
-                        clients[i].display_name[0] = '\0';
-                        clients[i].bio[0] = '\0';
-                        clients[i].pronouns[0] = '\0';
-
-                        send_line(cfd, "WELCOME CAVE/0.1");
-                        assigned = 1;
-                        break;
-                    }
-                }
-                if (!assigned) {
-                    send_line(cfd, "ERR :server full");
-                    close(cfd);
-                }
-            }
-        }
+    if (cfg.metrics_port && metrics_start() < 0) return 1;
+    if (upgrade_in >= 0 && upgrade_ack(upgrade_in) < 0) {
+        perror("upgrade");
+        return 1;
+    }
 
-        // existing clients
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (clients[i].fd != -1 && FD_ISSET(clients[i].fd, &rfds)) {
-                handle_client_data(&clients[i]);
-            }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = upgrade_signal;    // the loops already retry on EINTR
+    sigaction(SIGUSR1, &sa, NULL);
+#ifdef CAVE_TRACE
+    sa.sa_handler = trace_signal;
+    sigaction(SIGUSR2, &sa, NULL);
+#endif
+
+    printf("CAVE server listening on port %ld\n", cfg.port);
+    if (worker_count > 1) {
+        printf("%d worker threads\n", worker_count);
+    }
+    if (upgrade_in >= 0) {
+        printf("took over %zu clients\n", upgrade_taken);
+    }
+    fflush(stdout);
+
+    for (int i = 1; i < worker_count; i++) {
+        int err = pthread_create(&workers[i].thread, NULL,
+                                 worker_main, &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return 1;
         }
     }
 
-    close(listen_fd);
+    worker_main(&workers[0]);
     return 0;
 }
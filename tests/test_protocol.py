@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+# test_protocol.py - pins the server's replies to text commands
+#
+#   python3 tests/test_protocol.py ./cave_server
+#
+# Starts the server on a spare port in a scratch directory, sends each
+# case's lines on a fresh connection and compares what comes back (minus
+# WELCOME) with what the server has always answered. Exits non-zero if
+# any case differs.
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+CASES = [
+    # NICK takes the rest of the line as is; "NICK " drops the nick
+    (["NICK"], ["ERR :unknown command"]),
+    (["NICK bob"], ["SYS :nickname set"]),
+    (["NICK bob", "NICK "], ["SYS :nickname set", "SYS :nickname set"]),
+    (["NICK  bob"], ["ERR :bad nickname"]),
+
+    # MSG text is what follows the first ':', or the rest as is
+    (["MSG"], ["ERR :unknown command"]),
+    (["MSG hi there"], ["MSG @anon :hi there"]),
+    (["MSG @bob :hi there"], ["MSG @anon :hi there"]),
+    (["MSG :a:b"], ["MSG @anon :a:b"]),
+    (["MSG  spaced"], ["MSG @anon : spaced"]),
+    (["JOIN #t", "MSG #t :x:y"], ["JOIN #t @anon", "MSG #t @anon :x:y"]),
+    (["JOIN #t", "MSG #t hi"], ["JOIN #t @anon", "MSG #t @anon :hi"]),
+
+    # JOIN and PART need a name
+    (["JOIN"], ["ERR :unknown command"]),
+    (["JOIN  #t"], ["ERR :bad channel name"]),
+    (["JOIN #t", "PART"], ["JOIN #t @anon", "ERR :unknown command"]),
+
+    # PROFILE SET values follow a ':' and lose their leading spaces
+    (["NICK pp", "PROFILE SET BIO :  spaced  ", "PROFILE GET pp"],
+     ["SYS :nickname set", "PROFILE OK BIO",
+      "PROFILE DATA pp BIO :spaced  ", "PROFILE END pp"]),
+    (["NICK pq", "PROFILE SET BIO hi"],
+     ["SYS :nickname set", "PROFILE ERR SYNTAX"]),
+    (["PROFILE"], ["ERR :unknown command"]),
+    (["PROFILE SET"], ["PROFILE ERR SYNTAX"]),
+
+    (["PING"], ["PONG"]),
+    (["PROTO"], ["ERR :unknown command"]),
+    (["PROTO TEXT"], ["ERR :unknown protocol"]),
+    (["FOO"], ["ERR :unknown command"]),
+]
+
+
+def spare_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def read_lines(s, want):
+    data = b""
+    deadline = time.time() + 2
+    while time.time() < deadline:
+        lines = [l for l in data.decode(errors="replace").split("\r\n")[:-1]
+                 if not l.startswith("WELCOME")]
+        if len(lines) >= want:
+            break
+        try:
+            chunk = s.recv(65536)
+        except socket.timeout:
+            continue
+        if not chunk:
+            break
+        data += chunk
+    time.sleep(0.05)            # anything extra shows up as a mismatch
+    s.setblocking(False)
+    try:
+        data += s.recv(65536)
+    except BlockingIOError:
+        pass
+    return [l for l in data.decode(errors="replace").split("\r\n")
+            if l and not l.startswith("WELCOME")]
+
+
+def main():
+    server = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./cave_server")
+    port = spare_port()
+    with tempfile.TemporaryDirectory() as tmp:
+        proc = subprocess.Popen([server, "--port", str(port)],
+                                cwd=tmp, stdout=subprocess.DEVNULL)
+        try:
+            for _ in range(50):
+                try:
+                    socket.create_connection(("127.0.0.1", port)).close()
+                    break
+                except OSError:
+                    time.sleep(0.1)
+
+            failed = 0
+            for lines, expect in CASES:
+                s = socket.create_connection(("127.0.0.1", port))
+                s.settimeout(0.2)
+                for line in lines:
+                    s.sendall(line.encode() + b"\r\n")
+                got = read_lines(s, len(expect))
+                s.close()
+                if got != expect:
+                    print("FAIL %r\n  expected %r\n  got      %r" % (lines, expect, got))
+                    failed += 1
+            print("%d of %d cases passed" % (len(CASES) - failed, len(CASES)))
+            return 1 if failed else 0
+        finally:
+            proc.terminate()
+            proc.wait()
+
+
+if __name__ == "__main__":
+    sys.exit(main())